@@ -0,0 +1,198 @@
+#include "affinity.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <omp.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+const size_t TOUCH_PAGE_SIZE = 4096;
+
+void *first_touch_alloc(size_t bytes) {
+  size_t size = std::max((bytes + TOUCH_PAGE_SIZE - 1) / TOUCH_PAGE_SIZE, (size_t) 1) * TOUCH_PAGE_SIZE;
+  char *ptr = (char *) std::aligned_alloc(TOUCH_PAGE_SIZE, size);
+  if (ptr == nullptr) {
+    std::cerr << "Couldn't allocate " << size << " bytes" << std::endl;
+    exit(1);
+  }
+
+  // The kernels use the default (static) schedule over particles, so the
+  // same split over pages gives each thread the pages of its own particles.
+  long n_pages = size / TOUCH_PAGE_SIZE;
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < n_pages; i++) {
+    ptr[i * TOUCH_PAGE_SIZE] = 0;
+  }
+  return ptr;
+}
+
+void first_touch_free(void *ptr) {
+  std::free(ptr);
+}
+
+const size_t SCRATCH_ALIGNMENT = 64;
+
+ScratchArena::ScratchArena() {
+  block = nullptr;
+  capacity = 0;
+  used = 0;
+  overflow_bytes = 0;
+}
+
+ScratchArena::~ScratchArena() {
+  for (char *ptr: overflow) first_touch_free(ptr);
+  if (block) first_touch_free(block);
+}
+
+void ScratchArena::reset() {
+  if (overflow.size() > 0) {
+    // Last step didn't fit, grow the block to hold everything it used
+    size_t needed = used + overflow_bytes;
+    for (char *ptr: overflow) first_touch_free(ptr);
+    overflow.clear();
+    overflow_bytes = 0;
+    if (block) first_touch_free(block);
+    capacity = std::max(needed, capacity + capacity / 2);
+    block = (char *) first_touch_alloc(capacity);
+  }
+  used = 0;
+}
+
+void *ScratchArena::alloc(size_t bytes) {
+  bytes = (bytes + SCRATCH_ALIGNMENT - 1) / SCRATCH_ALIGNMENT * SCRATCH_ALIGNMENT;
+  if (used + bytes <= capacity) {
+    void *ptr = block + used;
+    used += bytes;
+    return ptr;
+  }
+
+  char *ptr = (char *) first_touch_alloc(bytes);
+  overflow.push_back(ptr);
+  overflow_bytes += bytes;
+  return ptr;
+}
+
+int cpu_package(int cpu) {
+  std::ifstream file("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/physical_package_id");
+  int package = 0;
+  if (file) file >> package;
+  return package;
+}
+
+int current_package() {
+#ifdef __linux__
+  return cpu_package(sched_getcpu());
+#else
+  return 0;
+#endif
+}
+
+void pin_threads(std::string policy) {
+#ifdef __linux__
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+
+  // (package, cpu) of every cpu we are allowed to run on
+  std::vector<std::pair<int, int>> cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed)) cpus.push_back(std::pair(cpu_package(cpu), cpu));
+  }
+  std::sort(cpus.begin(), cpus.end());
+
+  std::vector<int> order;
+  if (policy == "compact") {
+    for (auto cpu: cpus) order.push_back(cpu.second);
+  } else if (policy == "spread") {
+    // Round robin over packages
+    std::vector<std::vector<int>> packages;
+    for (auto cpu: cpus) {
+      if (packages.empty() || cpu_package(packages.back()[0]) != cpu.first) packages.push_back(std::vector<int>());
+      packages.back().push_back(cpu.second);
+    }
+    for (size_t i = 0; order.size() < cpus.size(); i++) {
+      for (auto &package: packages) {
+        if (i < package.size()) order.push_back(package[i]);
+      }
+    }
+  } else {
+    std::cerr << "Unknown affinity policy: " << policy << std::endl;
+    exit(1);
+  }
+
+  #pragma omp parallel
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(order[omp_get_thread_num() % order.size()], &set);
+    sched_setaffinity(0, sizeof(set), &set);
+  }
+  printf("Pinned %d threads (%s) over %zu cpus\n", omp_get_max_threads(), policy.c_str(), order.size());
+#else
+  std::cerr << "Thread pinning is only supported on Linux. Use OMP_PROC_BIND instead." << std::endl;
+#endif
+}
+
+// Each thread t reads the part of data first touched by thread source[t]
+double read_bandwidth(double *data, size_t count, std::vector<int> &source) {
+  int n_threads = source.size();
+  double sum = 0.0;
+  double start = omp_get_wtime();
+  #pragma omp parallel reduction(+: sum)
+  {
+    int t = source[omp_get_thread_num()];
+    size_t begin = count * t / n_threads;
+    size_t end = count * (t + 1) / n_threads;
+    for (size_t i = begin; i < end; i++) {
+      sum += data[i];
+    }
+  }
+  double elapsed = omp_get_wtime() - start;
+  if (sum != count) printf("Bandwidth check failed\n");
+  return count * sizeof(double) / elapsed / 1e9;
+}
+
+void print_numa_report() {
+  int n_threads = omp_get_max_threads();
+  size_t count = (32 << 20) / sizeof(double) * n_threads; // 32 MiB per thread
+  double *data = first_touch_array<double>(count);
+  #pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < count; i++) {
+    data[i] = 1.0;
+  }
+
+  std::vector<int> package(n_threads);
+  #pragma omp parallel num_threads(n_threads)
+  package[omp_get_thread_num()] = current_package();
+
+  // Remote source of a thread is the first thread on another package
+  std::vector<int> local(n_threads), remote(n_threads);
+  int n_packages = 1;
+  for (int t = 0; t < n_threads; t++) {
+    local[t] = t;
+    remote[t] = t;
+    for (int r = 0; r < n_threads; r++) {
+      if (package[r] != package[t]) {
+        remote[t] = r;
+        n_packages = 2;
+        break;
+      }
+    }
+  }
+
+  read_bandwidth(data, count, local); // warm up
+  double local_bw = read_bandwidth(data, count, local);
+  if (n_packages == 1) {
+    // All memory is local to the one socket, there's no remote to compare
+    printf("[NUMA threads %d] [Sockets 1] [Local %.2f GB/s]\n", n_threads, local_bw);
+  } else {
+    double remote_bw = read_bandwidth(data, count, remote);
+    printf("[NUMA threads %d] [Sockets >1] [Local %.2f GB/s] [Remote %.2f GB/s]\n", n_threads, local_bw, remote_bw);
+  }
+  first_touch_free(data);
+}
@@ -0,0 +1,64 @@
+#ifndef __SPH_AFFINITY
+#define __SPH_AFFINITY
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Page aligned allocation whose pages are first touched by the OpenMP
+// threads with the same static partitioning used by the particle loops,
+// so that on NUMA machines each thread's share lands on its own socket.
+void *first_touch_alloc(size_t bytes);
+void first_touch_free(void *ptr);
+
+template <class T>
+T *first_touch_array(size_t n) {
+  return (T *) first_touch_alloc(n * sizeof(T));
+}
+
+template <class T>
+struct FirstTouchAllocator {
+  typedef T value_type;
+
+  FirstTouchAllocator() = default;
+  template <class U>
+  FirstTouchAllocator(const FirstTouchAllocator<U> &) {}
+
+  T *allocate(size_t n) { return first_touch_array<T>(n); }
+  void deallocate(T *p, size_t) { first_touch_free(p); }
+
+  template <class U>
+  bool operator==(const FirstTouchAllocator<U> &) const { return true; }
+  template <class U>
+  bool operator!=(const FirstTouchAllocator<U> &) const { return false; }
+};
+
+// Bump allocator for per step temporaries. Buffers are cache line aligned
+// and valid until the next reset(). The block is reused every step and only
+// grows (at reset) when a step asked for more than it had.
+class ScratchArena {
+  char *block;
+  size_t capacity;
+  size_t used;
+  std::vector<char *> overflow;
+  size_t overflow_bytes;
+
+public:
+  ScratchArena();
+  ~ScratchArena();
+  ScratchArena(const ScratchArena &) = delete;
+  ScratchArena &operator=(const ScratchArena &) = delete;
+
+  void reset();
+  void *alloc(size_t bytes);
+  template <class T>
+  T *alloc_array(size_t n) { return (T *) alloc(n * sizeof(T)); }
+};
+
+// Pin OpenMP threads to cpus. policy is "compact" (fill a socket first)
+// or "spread" (round robin over sockets).
+void pin_threads(std::string policy);
+// Measure read bandwidth of thread local vs other socket's memory
+void print_numa_report();
+
+#endif
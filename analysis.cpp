@@ -0,0 +1,129 @@
+#include "analysis.h"
+#include "kernel.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+const std::vector<std::string> ANALYSIS_REDUCTIONS = {
+  "kinetic_energy", "density_error", "max_density_error", "max_velocity", "surface_height"};
+
+Analysis::Analysis(std::string reductions_str, std::string probes_file, bool _csv) {
+  csv = _csv;
+
+  std::stringstream reductions_stream(reductions_str);
+  std::string reduction;
+  while (std::getline(reductions_stream, reduction, ',')) {
+    if (std::find(ANALYSIS_REDUCTIONS.begin(), ANALYSIS_REDUCTIONS.end(), reduction) == ANALYSIS_REDUCTIONS.end()) {
+      std::cerr << "Unknown reduction: " << reduction << std::endl;
+      exit(1);
+    }
+    reductions.push_back(reduction);
+  }
+
+  if (probes_file != "") {
+    std::ifstream file(probes_file);
+    if (!file) {
+      std::cerr << "Couldn't open probes file " << probes_file << std::endl;
+      exit(1);
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+      std::istringstream words(line);
+      vec probe = {0};
+      if (!(words >> probe.x >> probe.y)) continue;
+#if SPH_DIM == 3
+      words >> probe.z;
+#endif
+      probes.push_back(probe);
+    }
+  }
+}
+
+void Analysis::write_header(std::ostream &out) {
+  std::vector<std::string> columns = {"time"};
+  for (auto &reduction: reductions) columns.push_back(reduction);
+  for (size_t i = 0; i < probes.size(); i++) {
+    columns.push_back("probe" + std::to_string(i) + "_pressure");
+    columns.push_back("probe" + std::to_string(i) + "_density");
+  }
+
+  if (csv) {
+    for (size_t i = 0; i < columns.size(); i++) {
+      out << (i > 0 ? "," : "") << columns[i];
+    }
+    out << "\n";
+  } else {
+    uint32_t count = columns.size();
+    out.write(reinterpret_cast<const char *>(&count), sizeof(uint32_t));
+    for (auto &column: columns) {
+      out.write(column.c_str(), column.size() + 1);
+    }
+  }
+}
+
+void Analysis::sample(World *w, std::ostream &out) {
+  double kinetic_energy = 0.0, density_error = 0.0, max_density_error = 0.0;
+  double max_vel_sq = 0.0, surface_height = -INFINITY;
+  int n_fluid = 0;
+  #pragma omp parallel for reduction(+: kinetic_energy, density_error, n_fluid) reduction(max: max_density_error, max_vel_sq, surface_height)
+  for (Particle &p: w->particles) {
+    if (p.boundary_particle) continue;
+    double vel_sq = norm_square(p.vel);
+    double rho_0 = w->rest_density(p);
+    double error = std::abs(p.rho - rho_0) / rho_0;
+    kinetic_energy += 0.5 * p.mass * vel_sq;
+    density_error += error;
+    max_density_error = std::max(max_density_error, error);
+    max_vel_sq = std::max(max_vel_sq, vel_sq);
+    surface_height = std::max(surface_height, p.pos.y);
+    n_fluid++;
+  }
+  if (n_fluid > 0) density_error /= n_fluid;
+
+  // Probes: pressure is a Shepard normalized interpolation over the fluid
+  //   p(x) = ∑ⱼ mⱼ/ρⱼ pⱼ W(x - xⱼ) / ∑ⱼ mⱼ/ρⱼ W(x - xⱼ)
+  // and density is the usual summation over all particles
+  double *P = w->alg->get_pressure();
+  std::vector<double> probe_values(2 * probes.size());
+  #pragma omp parallel for
+  for (size_t i = 0; i < probes.size(); i++) {
+    Particle probe = {0};
+    probe.idx = -1;
+    probe.pos = probes[i];
+    double pressure = 0.0, shepard = 0.0, rho = 0.0;
+    for (Particle *pj: w->grid->get_cell_neighbours(&probe)) {
+      double W_ij = W(distance(probe.pos, pj->pos));
+      rho += pj->mass * W_ij;
+      if (pj->boundary_particle) continue;
+      pressure += pj->mass / pj->rho * P[pj->idx] * W_ij;
+      shepard += pj->mass / pj->rho * W_ij;
+    }
+    probe_values[2 * i] = shepard > 0 ? pressure / shepard : 0.0;
+    probe_values[2 * i + 1] = rho;
+  }
+
+  std::vector<double> row = {w->time};
+  for (auto &reduction: reductions) {
+    if (reduction == "kinetic_energy") row.push_back(kinetic_energy);
+    else if (reduction == "density_error") row.push_back(density_error);
+    else if (reduction == "max_density_error") row.push_back(max_density_error);
+    else if (reduction == "max_velocity") row.push_back(std::sqrt(max_vel_sq));
+    else if (reduction == "surface_height") row.push_back(surface_height);
+  }
+  row.insert(row.end(), probe_values.begin(), probe_values.end());
+
+  if (csv) {
+    std::string line;
+    char value[32];
+    for (size_t i = 0; i < row.size(); i++) {
+      snprintf(value, sizeof(value), i > 0 ? ",%.9g" : "%.9g", row[i]);
+      line += value;
+    }
+    out << line << "\n";
+  } else {
+    out.write(reinterpret_cast<const char *>(row.data()), row.size() * sizeof(double));
+  }
+}
@@ -0,0 +1,31 @@
+#ifndef __SPH_ANALYSIS
+#define __SPH_ANALYSIS
+
+#include "types.h"
+#include <ostream>
+#include <string>
+#include <vector>
+
+// In-situ analysis, sampled after physics updates instead of post-processing
+// saved frames. Each sample is a row of time, the chosen reductions over the
+// fluid, and the pressure and density SPH interpolated at each probe.
+//
+// Reductions: kinetic_energy, density_error (average |ρ - ρ₀|/ρ₀),
+// max_density_error, max_velocity, surface_height (highest fluid particle)
+//
+// Output is CSV, or binary: u32 column count, the column names as null
+// terminated strings, then rows of f64.
+class Analysis {
+  std::vector<std::string> reductions;
+  std::vector<vec> probes;
+  bool csv;
+
+public:
+  // reductions is a comma separated list, probes_file has one probe
+  // position (x y [z]) per line
+  Analysis(std::string reductions, std::string probes_file, bool csv);
+  void write_header(std::ostream &out);
+  void sample(World *w, std::ostream &out);
+};
+
+#endif
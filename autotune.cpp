@@ -0,0 +1,210 @@
+#include "autotune.h"
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <omp.h>
+#include <unistd.h>
+
+const int WARM_UP_STEPS = 5;
+// A setting must beat the best so far by this fraction to replace it
+const double MIN_SPEEDUP = 0.03;
+
+typedef struct {
+  bool stable;
+  double wall_per_time; // Wall seconds per simulated second
+  double ms_per_step;
+  double density_error; // Average |ρ - ρ₀| / ρ₀ of the fluid at the end
+} Trial;
+
+Tuning default_tuning() {
+  return {omp_get_max_threads(), 2.0, 10, 0.5, 100};
+}
+
+std::string format_tuning(const Tuning &tuning) {
+  char text[128];
+  snprintf(text, sizeof(text), "threads=%d cell=%g hash=%d omega=%g iters=%d",
+           tuning.threads, tuning.cell_size, tuning.hash_factor, tuning.omega, tuning.max_iters);
+  return text;
+}
+
+void apply_tuning(World *w, const Tuning &tuning) {
+  omp_set_num_threads(tuning.threads);
+  w->grid->cell_size = tuning.cell_size * SUPPORT_RADIUS;
+  w->grid->hash_factor = tuning.hash_factor;
+  w->pressure_omega = tuning.omega;
+  w->max_pressure_iters = tuning.max_iters;
+  w->grid->build();
+}
+
+std::string cpu_model() {
+  std::ifstream cpuinfo("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(cpuinfo, line)) {
+    if (line.compare(0, 10, "model name") != 0) continue;
+    size_t colon = line.find(':');
+    if (colon != std::string::npos) return line.substr(line.find_first_not_of(' ', colon + 1));
+  }
+  return "unknown cpu";
+}
+
+std::string tuning_key(std::string scene_filename, std::string settings) {
+  char host[256] = "unknown host";
+  gethostname(host, sizeof(host) - 1);
+  std::ifstream scene(scene_filename, std::ios::binary);
+  std::stringstream contents;
+  contents << scene.rdbuf();
+  char hash[32];
+  snprintf(hash, sizeof(hash), "%016zx", std::hash<std::string>{}(contents.str()));
+  return std::string(host) + " | " + cpu_model() + " | " + std::to_string(omp_get_max_threads()) +
+    " threads | " + scene_filename + " " + hash + " | " + settings;
+}
+
+bool load_tuning(std::string cache_filename, std::string key, Tuning &tuning) {
+  std::ifstream file(cache_filename);
+  std::string line;
+  while (std::getline(file, line)) {
+    size_t tab = line.find('\t');
+    if (tab == std::string::npos || line.substr(0, tab) != key) continue;
+    Tuning t;
+    if (sscanf(line.c_str() + tab + 1, "threads=%d cell=%lf hash=%d omega=%lf iters=%d",
+               &t.threads, &t.cell_size, &t.hash_factor, &t.omega, &t.max_iters) == 5) {
+      tuning = t;
+      return true;
+    }
+  }
+  return false;
+}
+
+void save_tuning(std::string cache_filename, std::string key, const Tuning &tuning) {
+  // Other entries are kept, an old one of the key is replaced
+  std::vector<std::string> lines;
+  std::ifstream in(cache_filename);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.compare(0, key.size() + 1, key + "\t") != 0) lines.push_back(line);
+  }
+  in.close();
+  lines.push_back(key + "\t" + format_tuning(tuning));
+
+  std::ofstream out(cache_filename);
+  if (!out) {
+    std::cerr << "Couldn't save the tuning to " << cache_filename << std::endl;
+    return;
+  }
+  for (std::string &l: lines) out << l << "\n";
+}
+
+double fluid_density_error(World *w) {
+  double error = 0.0;
+  int n_fluid = 0;
+  #pragma omp parallel for reduction(+: error, n_fluid)
+  for (Particle &p: w->particles) {
+    if (p.boundary_particle) continue;
+    error += std::abs(p.rho - w->rest_density(p)) / w->rest_density(p);
+    n_fluid++;
+  }
+  return n_fluid ? error / n_fluid : 0.0;
+}
+
+Trial run_trial(std::function<World *()> &make_world, const Tuning &tuning, int steps) {
+  Trial trial = {true, 0.0, 0.0, 0.0};
+  omp_set_num_threads(tuning.threads);
+  World *w = make_world();
+  // Failures are what the trial looks for, not something to recover from
+  w->health = false;
+  apply_tuning(w, tuning);
+
+  double start = 0.0, start_time = 0.0;
+  for (int step = 0; step < WARM_UP_STEPS + steps; step++) {
+    if (step == WARM_UP_STEPS) {
+      start = omp_get_wtime();
+      start_time = w->time;
+    }
+    w->physics_update();
+    if (w->check_health() != "") {
+      trial.stable = false;
+      break;
+    }
+  }
+  if (trial.stable) {
+    double wall = omp_get_wtime() - start;
+    trial.wall_per_time = w->time > start_time ? wall / (w->time - start_time) : INFINITY;
+    trial.ms_per_step = 1000 * wall / steps;
+    trial.density_error = fluid_density_error(w);
+  }
+  delete w;
+  return trial;
+}
+
+Tuning autotune(std::function<World *()> make_world, std::string solver, double skin, int steps) {
+  Tuning best = default_tuning();
+  Trial best_trial = run_trial(make_world, best, steps);
+  printf("[Tune] %-55s %8.2f ms/step  density error %.5f\n", format_tuning(best).c_str(), best_trial.ms_per_step, best_trial.density_error);
+  if (!best_trial.stable) {
+    std::cerr << "The scene fails the health check with the default settings, not tuned" << std::endl;
+    return best;
+  }
+  double max_density_error = 1.25 * best_trial.density_error + 0.001;
+
+  auto consider = [&](Tuning tuning) {
+    Trial trial = run_trial(make_world, tuning, steps);
+    bool accepted = trial.stable && trial.density_error <= max_density_error;
+    if (trial.stable) {
+      printf("[Tune] %-55s %8.2f ms/step  density error %.5f%s\n", format_tuning(tuning).c_str(), trial.ms_per_step,
+             trial.density_error, accepted ? "" : " (inaccurate)");
+    } else {
+      printf("[Tune] %-55s unstable\n", format_tuning(tuning).c_str());
+    }
+    if (accepted && trial.wall_per_time < (1 - MIN_SPEEDUP) * best_trial.wall_per_time) {
+      best = tuning;
+      best_trial = trial;
+    }
+  };
+
+  // Threads: powers of two up to the available ones
+  int max_threads = best.threads;
+  for (int threads = 1; threads < max_threads; threads *= 2) {
+    Tuning t = best;
+    t.threads = threads;
+    consider(t);
+  }
+
+  // Cells must cover h + skin for the neighbour cells to hold the support
+  for (double cell_size: {1.0 + skin, 1.5}) {
+    if (cell_size < 1.0 + skin || cell_size == best.cell_size) continue;
+    Tuning t = best;
+    t.cell_size = cell_size;
+    consider(t);
+  }
+
+  for (int hash_factor: {3, 5, 20}) {
+    Tuning t = best;
+    t.hash_factor = hash_factor;
+    consider(t);
+  }
+
+  bool iisph = solver == "iisph" || solver == "iisph-mg";
+  if (iisph) {
+    for (double omega: {0.4, 0.6, 0.7}) {
+      Tuning t = best;
+      t.omega = omega;
+      consider(t);
+    }
+  }
+
+  // Lower caps only pay off when they're reached, the accuracy check keeps
+  // them from trading away the density error
+  if (iisph || solver == "dfsph") {
+    for (int max_iters: {50, 25}) {
+      Tuning t = best;
+      t.max_iters = max_iters;
+      consider(t);
+    }
+  }
+
+  printf("[Tune] Best: %s\n", format_tuning(best).c_str());
+  return best;
+}
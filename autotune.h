@@ -0,0 +1,40 @@
+#ifndef __SPH_AUTOTUNE
+#define __SPH_AUTOTUNE
+
+#include "types.h"
+#include <functional>
+#include <string>
+
+// Startup auto-tuner: short runs of the scene under alternative settings,
+// each from a fresh world, one setting at a time (threads, cell size, hash
+// map size, Jacobi weight, iteration cap) keeping the fastest. A setting is
+// only taken when every step stays healthy (World::check_health) and the
+// final density error is close to that of the defaults.
+//
+// Results are cached per scene and machine in a text file, one per line:
+//   <key>\tthreads=4 cell=1.5 hash=10 omega=0.5 iters=100
+
+typedef struct {
+  int threads;
+  double cell_size; // In h
+  int hash_factor;
+  double omega;
+  int max_iters;
+} Tuning;
+
+Tuning default_tuning();
+std::string format_tuning(const Tuning &tuning);
+// Sets the OpenMP threads and the world's settings, rebuilding its cells
+void apply_tuning(World *w, const Tuning &tuning);
+
+// Machine (host, cpu model, threads), scene file contents and the settings
+// that change the cost of a step
+std::string tuning_key(std::string scene_filename, std::string settings);
+bool load_tuning(std::string cache_filename, std::string key, Tuning &tuning);
+void save_tuning(std::string cache_filename, std::string key, const Tuning &tuning);
+
+// make_world returns a new configured world of the scene. Runs warm up
+// steps and then steps timed steps per trial. skin is the world's, in h.
+Tuning autotune(std::function<World *()> make_world, std::string solver, double skin, int steps);
+
+#endif
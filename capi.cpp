@@ -0,0 +1,175 @@
+#include "sph.h"
+#include "types.h"
+#include <algorithm>
+#include <string>
+
+static_assert(sizeof(Particle) % sizeof(double) == 0, "Particle fields are viewed as strided doubles");
+
+struct sph_world {
+  World *world;
+};
+
+thread_local std::string last_error;
+
+bool check_solver(const char *solver) {
+  if (known_solver(solver)) return true;
+  last_error = std::string("Unknown solver: ") + solver;
+  return false;
+}
+
+int sph_dimension(void) {
+  return SPH_DIM;
+}
+
+const char *sph_last_error(void) {
+  return last_error.c_str();
+}
+
+sph_world *sph_create_from_scene(const char *filename, int scale, const char *solver) {
+  if (!check_solver(solver)) return nullptr;
+  std::string error;
+  World *world = initialize_world(filename, std::max(1, scale), 8, solver, 30.0, 1000.0, false, &error);
+  if (!world) {
+    last_error = error;
+    return nullptr;
+  }
+  return new sph_world{world};
+}
+
+sph_world *sph_create(size_t n, const double *positions, const unsigned char *boundary, const char *solver) {
+  if (!check_solver(solver)) return nullptr;
+  if (n == 0) {
+    last_error = "No particles";
+    return nullptr;
+  }
+
+  std::vector<Particle> particles(n);
+  for (size_t i = 0; i < n; i++) {
+    Particle &p = particles[i];
+    p = {0};
+    p.idx = i;
+    p.boundary_particle = boundary && boundary[i];
+    p.symbol = p.boundary_particle ? '#' : 'o';
+    p.pos.x = positions[i * SPH_DIM];
+    p.pos.y = positions[i * SPH_DIM + 1];
+#if SPH_DIM == 3
+    p.pos.z = positions[i * SPH_DIM + 2];
+#endif
+  }
+  return new sph_world{create_world(particles, solver, 30.0, 1000.0)};
+}
+
+void sph_destroy(sph_world *w) {
+  if (!w) return;
+  delete w->world;
+  delete w;
+}
+
+int sph_set(sph_world *w, const char *name, double value) {
+  World *world = w->world;
+  std::string param = name;
+  if (param == "max_dt") world->max_dt = value;
+  else if (param == "tolerance") world->tolerance = value;
+  else if (param == "viscosity") world->viscosity = value;
+  else if (param == "xsph") world->xsph = value;
+  else if (param == "surface_tension") world->surface_tension = value;
+  else if (param == "gravity_x") world->gravity.x = value;
+  else if (param == "gravity_y") world->gravity.y = value;
+#if SPH_DIM == 3
+  else if (param == "gravity_z") world->gravity.z = value;
+#endif
+  else if (param == "skin") {
+    // The cells have to cover h + skin
+    if (!(value >= 0 && value <= 1) || SUPPORT_RADIUS * (1 + value) > world->grid->cell_size) {
+      last_error = "skin must be between 0 and 1, and fit the cells";
+      return -1;
+    }
+    world->grid->skin = value * SUPPORT_RADIUS;
+  }
+  else if (param == "symmetric" || param == "tiled") {
+    bool &mode = param == "symmetric" ? world->symmetric : world->tiled;
+    bool other = param == "symmetric" ? world->tiled : world->symmetric;
+    if (value != 0 && other) {
+      last_error = "symmetric and tiled are different traversals, pick one";
+      return -1;
+    }
+    mode = value != 0;
+  }
+  else if (param == "health") world->health = value != 0;
+  else {
+    last_error = "Unknown parameter: " + param;
+    return -1;
+  }
+  return 0;
+}
+
+int sph_set_phase(sph_world *w, char symbol, double rho_0, double viscosity) {
+  World *world = w->world;
+  if (!(rho_0 > 0)) {
+    last_error = "Rest density must be positive";
+    return -1;
+  }
+  if (world->phase_of(symbol) == 0 && world->phases.size() == 256) {
+    last_error = "Too many phases";
+    return -1;
+  }
+  world->add_phase({symbol, rho_0, viscosity});
+  return 0;
+}
+
+double sph_step(sph_world *w) {
+  double time = w->world->time;
+  w->world->physics_update();
+  return w->world->time - time;
+}
+
+double sph_time(sph_world *w) {
+  return w->world->time;
+}
+
+size_t sph_count(sph_world *w) {
+  return w->world->particles.size();
+}
+
+int sph_is_boundary(sph_world *w, size_t i) {
+  return w->world->particles[i].boundary_particle;
+}
+
+// A field of the particles as strided doubles
+sph_span particle_span(sph_world *w, double *first, int components) {
+  ParticleVector &particles = w->world->particles;
+  if (particles.empty()) return {nullptr, 0, 0, components};
+  return {first, particles.size(), sizeof(Particle) / sizeof(double), components};
+}
+
+sph_span sph_positions(sph_world *w) {
+  return particle_span(w, &w->world->particles[0].pos.x, SPH_DIM);
+}
+
+sph_span sph_velocities(sph_world *w) {
+  return particle_span(w, &w->world->particles[0].vel.x, SPH_DIM);
+}
+
+sph_span sph_densities(sph_world *w) {
+  return particle_span(w, &w->world->particles[0].rho, 1);
+}
+
+sph_span sph_masses(sph_world *w) {
+  return particle_span(w, &w->world->particles[0].mass, 1);
+}
+
+sph_span sph_pressures(sph_world *w) {
+  return {w->world->alg->get_pressure(), w->world->particles.size(), 1, 1};
+}
+
+int sph_timings(sph_world *w, sph_timing *timings, int max) {
+  int count = 0;
+  for (auto &timing: w->world->timings) {
+    if (count < max) {
+      Timing &t = timing.second;
+      timings[count] = {timing.first.c_str(), (double) t.get_current(), t.get_mean(), t.get_std()};
+    }
+    count++;
+  }
+  return count;
+}
@@ -0,0 +1,202 @@
+#include "types.h"
+#include "kernel.h"
+#include <cassert>
+#include <cmath>
+#include "physics.h"
+#include "dfsph.h"
+
+// Divergence-Free SPH (Bender & Koschier 2015)
+//
+// Both solvers below change velocities by
+//   Δvᵢ = - dt ∑ⱼ mⱼ (κᵢ/ρᵢ + κⱼ/ρⱼ) ∇W_{ij}
+// with the stiffness κᵢ computed from a per particle factor
+//   αᵢ = ρᵢ / (|∑ⱼ mⱼ ∇W_{ij}|² + ∑ⱼ |mⱼ ∇W_{ij}|²)
+// that depends only on positions and so is computed once per step.
+
+double dfsph_compute_time_step(World *w) {
+  double max_vel_sq = 0.0;
+  #pragma omp parallel for reduction(max : max_vel_sq)
+  for (Particle &p: w->particles) {
+    max_vel_sq = std::max(max_vel_sq, norm_square(p.vel));
+  }
+  // DFSPH stays stable at twice the CFL number of IISPH
+  double cfl_delta = max_vel_sq == 0.0 ? 1: 0.4 * SUPPORT_RADIUS / sqrt(max_vel_sq);
+  double dt = std::min(w->max_dt, cfl_delta);
+  w->log("dt", dt);
+  return dt;
+}
+
+// Computes αᵢ and returns the number of particles taking part in the solve
+int dfsph_compute_factors(World *w, double *alpha) {
+  int n_fluid = 0;
+  #pragma omp parallel for reduction(+: n_fluid)
+  for (Particle &p: w->particles) {
+    if (p.boundary_particle) {
+      alpha[p.idx] = 0;
+      continue;
+    }
+
+    vec sum_grad = {0};
+    double sum_grad_sq = 0.0;
+    for (Particle *pj: w->grid->get_neighbours(&p)) {
+      vec grad = pj->mass * gradW(p.pos, pj->pos);
+      sum_grad += grad;
+      if (!pj->boundary_particle) sum_grad_sq += norm_square(grad);
+    }
+
+    // Isolated particles are excluded (αᵢ = 0)
+    double denominator = norm_square(sum_grad) + sum_grad_sq;
+    alpha[p.idx] = denominator > 1e-6 ? p.rho / denominator : 0.0;
+    if (alpha[p.idx]) n_fluid++;
+  }
+  return n_fluid;
+}
+
+void dfsph_apply_stiffness(World *w, double dt, double *alpha, double *kappa) {
+  #pragma omp parallel for
+  for (Particle &p: w->particles) {
+    if (!alpha[p.idx]) continue;
+    double ki = kappa[p.idx] / p.rho;
+    vec sum = {0};
+    for (Particle *pj: w->grid->get_neighbours(&p)) {
+      // Boundary particles only pass on the fluid particle's own pressure
+      double kj = pj->boundary_particle ? 0.0 : kappa[pj->idx] / pj->rho;
+      sum += pj->mass * (ki + kj) * gradW(p.pos, pj->pos);
+    }
+    p.vel += -dt * sum;
+  }
+}
+
+// Make velocities divergence free: Dρ/Dt = 0
+int dfsph_divergence_solve(World *w, double dt, double *alpha, double *kappa, int n_fluid) {
+  double tolerance = n_fluid * w->tolerance * w->rho_0; // Relative to ρ₀ over a time step
+  double error;
+  int iters = 0;
+  do {
+    error = 0.0;
+    iters++;
+    #pragma omp parallel for reduction(+: error)
+    for (Particle &p: w->particles) {
+      if (!alpha[p.idx]) {
+        kappa[p.idx] = 0;
+        continue;
+      }
+      // Only compression is corrected
+      double drho_dt = std::max(0.0, density_derivative(w, &p));
+      kappa[p.idx] = drho_dt / dt * alpha[p.idx];
+      error += dt * drho_dt;
+    }
+    dfsph_apply_stiffness(w, dt, alpha, kappa);
+  } while (error >= tolerance && iters < w->max_pressure_iters);
+  return iters;
+}
+
+// Correct the density error of the predicted density: ρ* = ρ₀
+void dfsph_density_solve(World *w, double dt, double *alpha, double *kappa, int n_fluid, double *P) {
+  #pragma omp parallel for
+  for (size_t i = 0; i < w->particles.size(); i++) {
+    P[i] = 0;
+  }
+
+  double dt2 = dt * dt;
+  double tolerance = n_fluid * w->tolerance * w->rho_0; // Relative to ρ₀
+  double error;
+  int iters = 0;
+  do {
+    error = 0.0;
+    iters++;
+    #pragma omp parallel for reduction(+: error)
+    for (Particle &p: w->particles) {
+      if (!alpha[p.idx]) {
+        kappa[p.idx] = 0;
+        continue;
+      }
+      double density_prediction = p.rho + dt * density_derivative(w, &p);
+      double density_error = std::max(0.0, density_prediction - w->rest_density(p));
+      kappa[p.idx] = density_error / dt2 * alpha[p.idx];
+      // κ = p/ρ, so the pressure applied is the sum of κᵢρᵢ over iterations
+      P[p.idx] += kappa[p.idx] * p.rho;
+      error += density_error;
+    }
+    dfsph_apply_stiffness(w, dt, alpha, kappa);
+  } while ((error >= tolerance || iters < 2) && iters < w->max_pressure_iters);
+
+  w->log("PPE Iters", iters);
+  w->log("PPE Error", error / std::max(n_fluid, 1));
+}
+
+DFSPH::~DFSPH() {
+  if (pressure) first_touch_free(pressure);
+}
+
+void DFSPH::particles_changed(const std::vector<int> &old_index) {
+  remap_particle_array(pressure, capacity, old_index);
+}
+
+double *DFSPH::get_pressure() {
+  return pressure;
+}
+
+double DFSPH::physics_update() {
+  // Update neighbours
+  w->timer_start("Build Grid");
+  w->update_neighbours();
+  w->timer_end("Build Grid");
+
+  // Compute density and DFSPH factors
+  w->timer_start("Compute Density");
+  compute_density_and_forces(w);
+  double *alpha = w->scratch.alloc_array<double>(w->particles.size());
+  double *kappa = w->scratch.alloc_array<double>(w->particles.size());
+  int n_fluid = dfsph_compute_factors(w, alpha);
+  w->timer_end("Compute Density");
+
+  // Make velocities of the last step divergence free
+  if (last_dt > 0) {
+    w->timer_start("Divergence Solve");
+    int iters = dfsph_divergence_solve(w, last_dt, alpha, kappa, n_fluid);
+    w->log("Div Iters", iters);
+    w->timer_end("Divergence Solve");
+  }
+
+  w->timer_start("dt,F_nonp");
+  // Compute timestep
+  double dt = dfsph_compute_time_step(w);
+
+  // Apply non pressure forces
+  #pragma omp parallel for
+  for (Particle& p: w->particles) {
+    if (!p.boundary_particle) {
+      p.vel += dt * (w->viscous_acceleration(p) + w->external_acceleration(p)) + w->xsph_correction(p);
+    }
+  }
+  w->timer_end("dt,F_nonp");
+
+  // Correct density error
+  w->timer_start("Compute Pressure");
+  dfsph_density_solve(w, dt, alpha, kappa, n_fluid, pressure);
+  w->timer_end("Compute Pressure");
+
+  // Update position
+  w->timer_start("Apply forces");
+  #pragma omp parallel for
+  for (Particle& p: w->particles) {
+    if (!p.boundary_particle) {
+      p.pos += dt * p.vel;
+    }
+  }
+  w->timer_end("Apply forces");
+
+  last_dt = dt;
+  return dt;
+}
+
+void DFSPH::initialize(World *_w) {
+  w = _w;
+  last_dt = 0;
+  capacity = w->particles.size();
+  pressure = first_touch_array<double>(capacity);
+  for (size_t i = 0; i < w->particles.size(); i++) {
+    pressure[i] = 0;
+  }
+}
@@ -0,0 +1,20 @@
+#ifndef __DFSPH
+#define __DFSPH
+
+#include "types.h"
+
+class DFSPH: public Algorithm {
+private:
+  double *pressure = nullptr;
+  size_t capacity;
+  double last_dt;
+  World *w;
+
+public:
+  ~DFSPH();
+  virtual double *get_pressure();
+  virtual void initialize(World *w);
+  virtual double physics_update();
+  virtual void particles_changed(const std::vector<int> &old_index);
+};
+#endif
@@ -1,135 +1,386 @@
 #include "vec2.h"
 #include "types.h"
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdint>
 #include <iostream>
 
-GridId grid_id(vec2 pos) {
+GridId grid_id(vec pos, double cell_size) {
   GridId result;
-  result.x = floor(pos.x / (2 * SUPPORT_RADIUS));
-  result.y = floor(pos.y / (2 * SUPPORT_RADIUS));
+  result.x = floor(pos.x / cell_size);
+  result.y = floor(pos.y / cell_size);
+#if SPH_DIM == 3
+  result.z = floor(pos.z / cell_size);
+#endif
   return result;
 }
 
 bool grid_id_equal(GridId &g1, GridId &g2) {
+#if SPH_DIM == 3
+  if (g1.z != g2.z) return false;
+#endif
   return g1.x == g2.x && g1.y == g2.y;
 }
 
-int grid_id_hash(GridId &id, uint64_t size) {
-  uint64_t hash = ((uint64_t) abs(id.x) * 73856093 + (uint64_t) abs(id.y) * 19349663) %  size;
-  assert(hash >= 0);
-  return hash;
+// Teschner et al. 2003 over the two's complement bits of the coordinates,
+// so that cells mirrored about an axis don't collide
+uint64_t grid_id_hash(GridId &id, uint64_t size) {
+  uint64_t hash = (uint64_t) (uint32_t) id.x * 73856093 ^ (uint64_t) (uint32_t) id.y * 19349663;
+#if SPH_DIM == 3
+  hash ^= (uint64_t) (uint32_t) id.z * 83492791;
+#endif
+  return hash % size;
 }
 
 GridHashMap::GridHashMap(int size): size(size) {
   grid_hash_map = new GridBox[size];
+  probe_sum = 0;
+  probe_max = 0;
+}
+
+GridHashMap::~GridHashMap() {
+  delete[] grid_hash_map;
+}
+
+int GridHashMap::get_size() {
+  return size;
+}
+
+void GridHashMap::resize(int _size) {
+  delete[] grid_hash_map;
+  size = _size;
+  grid_hash_map = new GridBox[size];
+  placed.clear();
+  used.clear();
 }
 
 void GridHashMap::clear() {
-  for (int idx = 0; idx < size; idx++) {
-    grid_hash_map[idx].used = false;
-    grid_hash_map[idx].particles.clear();
-    grid_hash_map[idx].grid_id.x = 0;
-    grid_hash_map[idx].grid_id.y = 0;
+  // Only the placed boxes, a few percent of the map
+  for (GridBox *box: placed) {
+    box->used = false;
+    box->index = -1;
+    box->particles.clear();
+    box->grid_id = {0};
   }
+  placed.clear();
+  used.clear();
+  probe_sum = 0;
+  probe_max = 0;
 }
 
-void GridHashMap::insert(Particle *p) {
-  GridId id = grid_id(p->pos);
-  GridBox *grid = find_grid(id);
+GridBox *GridHashMap::insert(Particle *p, GridId id) {
+  int idx = grid_id_hash(id, size);
+  int probes = 0;
+  GridBox *grid = grid_hash_map + idx;
+  while (grid->used && !grid_id_equal(grid->grid_id, id)) {
+    idx = (idx + 1) % size;
+    grid = grid_hash_map + idx;
+    if (++probes == size) {
+      std::cerr << "Hash map full. Panic!" << std::endl;
+      exit(1);
+    }
+  }
+
+  if (!grid->used) {
+    grid->grid_id = id;
+    grid->used = true;
+    placed.push_back(grid);
+    probe_sum += probes;
+    probe_max = std::max(probe_max, probes);
+  }
+  if (grid->particles.empty()) {
+    grid->index = used.size();
+    used.push_back(grid);
+  }
   grid->particles.push_back(p);
+  return grid;
+}
+
+void GridHashMap::remove(Particle *p, GridBox *box) {
+  auto &ps = box->particles;
+  auto found = std::find(ps.begin(), ps.end(), p);
+  assert(found != ps.end()); // The particle must be in the box it's removed from
+  if (found == ps.end()) return;
+  *found = ps.back();
+  ps.pop_back();
+  if (!ps.empty()) return;
+
+  // Leaves the used boxes, swapping the last one into its place
+  GridBox *last = used.back();
+  used[box->index] = last;
+  last->index = box->index;
+  used.pop_back();
+  box->index = -1;
 }
 
 GridBox *GridHashMap::find_grid(GridId grid_id) {
   int idx = grid_id_hash(grid_id, size);
-  int start_idx = idx;
   GridBox *grid = grid_hash_map + idx;
-  do {
-    if (grid->used == false) {
-      grid->grid_id = grid_id;
-      grid->used = true;
-      return grid;
-    }
-
-    if (grid_id_equal(grid->grid_id, grid_id)) {
-      return grid;
-    }
-
+  // A probe chain is never longer than the longest one of insert()
+  for (int probes = 0; probes <= probe_max; probes++) {
+    if (!grid->used) return nullptr;
+    if (grid_id_equal(grid->grid_id, grid_id)) return grid;
     idx = (idx + 1) % size;
     grid = grid_hash_map + idx;
-    if (idx == start_idx) {
-      std::cerr << "Hash map full. Panic!" << std::endl;
-      exit(1);
-    }
-  } while (true);
+  }
+  return nullptr;
+}
+
+const std::vector<GridBox*> &GridHashMap::used_boxes() {
+  return used;
+}
+
+double GridHashMap::load_factor() {
+  return (double) placed.size() / size;
+}
+
+double GridHashMap::mean_probe_length() {
+  return placed.empty() ? 0.0 : (double) probe_sum / placed.size();
 }
 
-Grid::Grid(std::vector<Particle> *ps): grid_hash_map(10 * ps->size()) {
+int GridHashMap::max_probe_length() {
+  return probe_max;
+}
+
+Grid::Grid(ParticleVector *ps): grid_hash_map(10 * ps->size()) {
   particles = ps;
+  cell_size = 2 * SUPPORT_RADIUS;
+  hash_factor = 10;
+  list_valid = false;
+  skin = 0.0;
+  rebuilds = 0;
+  incremental = false;
+  rebuild_fraction = 0.1;
+  moved = -1;
 }
 
 void Grid::build() {
+  list_valid = false;
+  if (cell_size < SUPPORT_RADIUS + skin) {
+    std::cerr << "Cells of " << cell_size / SUPPORT_RADIUS << "h don't cover the neighbours within (1 + skin)h" << std::endl;
+    exit(1);
+  }
+  // Grows with the particles, and shrinks when hash_factor was lowered
+  size_t map_size = grid_hash_map.get_size();
+  if (hash_factor * particles->size() > map_size || hash_factor * particles->capacity() < map_size) {
+    grid_hash_map.resize(hash_factor * particles->capacity());
+  }
   grid_hash_map.clear();
-  for (std::vector<Particle>::iterator it = particles->begin(); it != particles->end(); ++it) {
+  particle_box.resize(particles->size());
+  particle_cell.resize(particles->size());
+  for (ParticleVector::iterator it = particles->begin(); it != particles->end(); ++it) {
     Particle *p = &(*it);
-    grid_hash_map.insert(p);
+    particle_box[p->idx] = grid_hash_map.insert(p, grid_id(p->pos, cell_size));
+    particle_cell[p->idx] = particle_box[p->idx]->grid_id;
   }
+  moved = -1;
+}
+
+bool Grid::move_changed() {
+  size_t n = particles->size();
+  if (particle_box.size() != n) return false;
+
+  // The particles that left their cell, found in parallel and sorted so that
+  // the cells' order doesn't depend on the threads
+  changed.clear();
+  #pragma omp parallel
+  {
+    std::vector<int> changed_t;
+    #pragma omp for nowait
+    for (size_t i = 0; i < n; i++) {
+      Particle &p = (*particles)[i];
+      if (p.boundary_particle) continue; // Never move
+      GridId id = grid_id(p.pos, cell_size);
+      if (!grid_id_equal(id, particle_cell[i])) changed_t.push_back(i);
+    }
+    #pragma omp critical
+    changed.insert(changed.end(), changed_t.begin(), changed_t.end());
+  }
+  if (changed.size() > rebuild_fraction * n) return false;
+  std::sort(changed.begin(), changed.end());
+
+  for (int i: changed) {
+    Particle *p = &(*particles)[i];
+    grid_hash_map.remove(p, particle_box[i]);
+    particle_box[i] = grid_hash_map.insert(p, grid_id(p->pos, cell_size));
+    particle_cell[i] = particle_box[i]->grid_id;
+  }
+  moved = changed.size();
+  return true;
+}
+
+void Grid::build_list() {
+  int n = particles->size();
+  double radius_sq = (SUPPORT_RADIUS + skin) * (SUPPORT_RADIUS + skin);
+  list_start.resize(n + 1);
+  list_upper.resize(n);
+  list_pos.resize(n);
+
+  // Count, then fill. Cells of at least h + skin cover the list's radius.
+  list_start[0] = 0;
+  #pragma omp parallel for
+  for (int i = 0; i < n; i++) {
+    Particle *p = &(*particles)[i];
+    int count = 0;
+    for (Particle *np: get_neighbours(p)) {
+      if (norm_square(np->pos - p->pos) < radius_sq) count++;
+    }
+    list_start[i + 1] = count;
+    list_pos[i] = p->pos;
+  }
+
+  for (int i = 0; i < n; i++) {
+    list_start[i + 1] += list_start[i];
+  }
+  list.resize(list_start[n]);
+
+  #pragma omp parallel for
+  for (int i = 0; i < n; i++) {
+    Particle *p = &(*particles)[i];
+    int k = list_start[i];
+    for (Particle *np: get_neighbours(p)) {
+      if (norm_square(np->pos - p->pos) < radius_sq) list[k++] = np;
+    }
+    auto upper = std::stable_partition(list.begin() + list_start[i], list.begin() + k,
+                                       [p](Particle *np) { return np->idx < p->idx; });
+    list_upper[i] = upper - list.begin();
+  }
+  list_valid = true;
+}
+
+bool Grid::update() {
+  if (list_valid) {
+    double max_sq = 0.0;
+    #pragma omp parallel for reduction(max: max_sq)
+    for (Particle &p: *particles) {
+      max_sq = std::max(max_sq, norm_square(p.pos - list_pos[p.idx]));
+    }
+    if (max_sq <= skin * skin / 4) {
+      moved = 0;
+      return false;
+    }
+  }
+
+  if (incremental && move_changed()) {
+    list_valid = false;
+  } else {
+    build();
+  }
+  if (skin > 0) build_list();
+  rebuilds++;
+  return true;
+}
+
+GridHashMap *Grid::get_hash_map() {
+  return &grid_hash_map;
 }
 
 Neighbours Grid::get_neighbours(Particle *p) {
-  return Neighbours(this, p);
+  return Neighbours(this, p, true, false);
+}
+
+Neighbours Grid::get_cell_neighbours(Particle *p) {
+  return Neighbours(this, p, false, false);
 }
 
-Neighbours::Neighbours(Grid *g, Particle *p) {
+Neighbours Grid::get_half_neighbours(Particle *p) {
+  return Neighbours(this, p, true, true);
+}
+
+Neighbours::Neighbours(Grid *g, Particle *p, bool _use_list, bool _half) {
   grid = g;
   particle = p;
+  use_list = _use_list;
+  half = _half;
 }
 
 NeighbourIterator Neighbours::begin() {
-  return NeighbourIterator(grid, particle, false);
+  return NeighbourIterator(grid, particle, false, use_list, half);
 };
 
 NeighbourIterator Neighbours::end() {
-  return NeighbourIterator(grid, particle, true);
+  return NeighbourIterator(grid, particle, true, use_list, half);
 }
 
-NeighbourIterator::NeighbourIterator(Grid* g, Particle* p, bool _is_end) {
+#if SPH_DIM == 3
+const int NEIGHBOUR_CELLS = 27;
+const GridId grid_neigbour_idx_offsets[27] = {
+  {-1, -1, -1}, {0, -1, -1}, {1, -1, -1}, {-1, 0, -1}, {0, 0, -1}, {1, 0, -1}, {-1, 1, -1}, {0, 1, -1}, {1, 1, -1},
+  {-1, -1,  0}, {0, -1,  0}, {1, -1,  0}, {-1, 0,  0}, {0, 0,  0}, {1, 0,  0}, {-1, 1,  0}, {0, 1,  0}, {1, 1,  0},
+  {-1, -1,  1}, {0, -1,  1}, {1, -1,  1}, {-1, 0,  1}, {0, 0,  1}, {1, 0,  1}, {-1, 1,  1}, {0, 1,  1}, {1, 1,  1}};
+#else
+const int NEIGHBOUR_CELLS = 9;
+const GridId grid_neigbour_idx_offsets[9] = {{-1, -1}, {0, -1}, {1, -1},
+                                             {-1, 0},  {0, 0},  {1, 0},
+                                             {-1, 1},  {0, 1},  {1, 1}};
+#endif
+
+int Grid::get_neighbour_boxes(GridBox *box, GridBox **boxes) {
+  int count = 0;
+  for (int i = 0; i < NEIGHBOUR_CELLS; i++) {
+    GridId g = box->grid_id;
+    g.x += grid_neigbour_idx_offsets[i].x;
+    g.y += grid_neigbour_idx_offsets[i].y;
+#if SPH_DIM == 3
+    g.z += grid_neigbour_idx_offsets[i].z;
+#endif
+    GridBox *neighbour = grid_hash_map.find_grid(g);
+    if (neighbour && neighbour->particles.size() != 0) boxes[count++] = neighbour;
+  }
+  return count;
+}
+
+NeighbourIterator::NeighbourIterator(Grid* g, Particle* p, bool _is_end, bool use_list, bool _half) {
   grid = g;
   particle = p;
   is_end = _is_end;
+  half = _half;
+
+  if (use_list && grid->list_valid) {
+    // The particle's list is iterated as if it were the last cell
+    particle_iter = grid->list.begin() + (half ? grid->list_upper[p->idx] : grid->list_start[p->idx]);
+    particle_iter_end = grid->list.begin() + grid->list_start[p->idx + 1];
+    grid_iter_i = particle_iter == particle_iter_end ? NEIGHBOUR_CELLS : NEIGHBOUR_CELLS - 1;
+    return;
+  }
 
-  particle_grid_id = grid_id(p->pos);
-  grid_iter_i = -1;
+  particle_grid_id = grid_id(p->pos, grid->cell_size);
+  // The offsets after the particle's own cell are the negations of the ones
+  // before it
+  grid_iter_i = half ? NEIGHBOUR_CELLS / 2 - 1 : -1;
   find_next_grid();
 }
 
-const GridId grid_neigbour_idx_offsets[9] = {{-1, -1}, {0, -1}, {1, -1},
-                                             {-1, 0},  {0, 0},  {1, 0},
-                                             {-1, 1},  {0, 1},  {1, 1}};
 
 bool NeighbourIterator::find_next_grid() {
-  if (grid_iter_i == 9) {
+  if (grid_iter_i == NEIGHBOUR_CELLS) {
     return false;
   }
 
   const GridBox *grid_box;
   do {
     grid_iter_i++;
-    if (grid_iter_i == 9) {
+    if (grid_iter_i == NEIGHBOUR_CELLS) {
       return false;
     }
 
     GridId g = particle_grid_id;
     g.x += grid_neigbour_idx_offsets[grid_iter_i].x;
     g.y += grid_neigbour_idx_offsets[grid_iter_i].y;
+#if SPH_DIM == 3
+    g.z += grid_neigbour_idx_offsets[grid_iter_i].z;
+#endif
 
     grid_box = grid->grid_hash_map.find_grid(g);
 
-    if (grid_box->particles.size() != 0) {
+    if (grid_box && grid_box->particles.size() != 0) {
       particle_iter = grid_box->particles.begin();
       particle_iter_end = grid_box->particles.end();
-      if (*particle_iter == particle) {
+      if (half && grid_iter_i == NEIGHBOUR_CELLS / 2) {
+        particle_iter = std::find(particle_iter, particle_iter_end, particle);
+      }
+      if (particle_iter != particle_iter_end && *particle_iter == particle) {
         particle_iter++;
       }
       if (particle_iter != particle_iter_end) {
@@ -142,7 +393,7 @@ bool NeighbourIterator::find_next_grid() {
 }
 
 NeighbourIterator& NeighbourIterator::operator++() {
-  if (grid_iter_i == 9) {
+  if (grid_iter_i == NEIGHBOUR_CELLS) {
      // No next particle
   } else {
     ++particle_iter;
@@ -160,7 +411,7 @@ Particle* NeighbourIterator::operator*() {
 
 
 bool NeighbourIterator::operator==(const NeighbourIterator& other) const {
-  return other.is_end && grid_iter_i == 9;
+  return other.is_end && grid_iter_i == NEIGHBOUR_CELLS;
 }
 
 bool NeighbourIterator::operator!=(const NeighbourIterator& other) const {
@@ -3,9 +3,14 @@
 #include <cassert>
 #include <cmath>
 #include <cstdlib>
-#include <memory>
 #include "physics.h"
 #include "iisph.h"
+#include "multigrid.h"
+#include "tiles.h"
+
+// Fraction of the residual a multigrid cycle has to stay under, or Jacobi
+// takes over the solve. A cycle costs about four Jacobi iterations.
+const double MG_MIN_REDUCTION = 0.9;
 
 double iisph_compute_time_step(World *w) {
   double max_vel_sq = 0.0;
@@ -14,19 +19,198 @@ double iisph_compute_time_step(World *w) {
     max_vel_sq = std::max(max_vel_sq, norm_square(p.vel));
   }
   double cfl_delta = max_vel_sq == 0.0 ? 1: 0.2 * SUPPORT_RADIUS / sqrt(max_vel_sq);
-  double dt = std::min(0.005, cfl_delta);
+  double dt = std::min(w->max_dt, cfl_delta);
   w->log("dt", dt);
   return dt;
 };
 
-void iisph_compute_pressure(double dt, World *w, double *P) {
+// Neighbour sums of a fluid particle needed for aᵢᵢ and sᵢ
+typedef struct DiagonalSums {
+  vec inner;      // ∑ⱼ mⱼ ∇W_ij
+  double grad_sq; // ∑ⱼ mⱼ |∇W_ij|²
+  double div;     // ∑ⱼ mⱼ (vⱼ - vᵢ) · ∇W_ij, masses scaled as in the density
+
+  DiagonalSums &operator+=(const DiagonalSums &other) {
+    inner += other.inner;
+    grad_sq += other.grad_sq;
+    div += other.div;
+    return *this;
+  }
+} DiagonalSums;
+
+// aᵢᵢ and sᵢ over the half neighbour list. With the inner sum known, the
+// outer sum of aᵢᵢ is
+//   ∑ⱼ mⱼ [mᵢ ∇W_ij + inner] · ∇W_ij = mᵢ ∑ⱼ mⱼ |∇W_ij|² + |inner|²
+void iisph_compute_diagonal_symmetric(double dt, World *w, double *aii, double *s) {
+  size_t n = w->particles.size();
+  PairSums<DiagonalSums> sums(w->scratch, n);
+
+#pragma omp parallel
+  {
+    PairSums<DiagonalSums>::Local sums_t = sums.local();
+    for (size_t i = sums_t.begin; i < sums_t.end; i++) {
+      Particle *pi = &w->particles[i];
+      for (Particle *pj: w->grid->get_half_neighbours(pi)) {
+        if (pi->boundary_particle && pj->boundary_particle) continue;
+        if (distance(pi->pos, pj->pos) >= SUPPORT_RADIUS) continue;
+
+        vec grad = gradW(pi->pos, pj->pos);
+        double grad_sq = norm_square(grad);
+        double div = dot(pj->vel - pi->vel, grad);
+        if (!pi->boundary_particle) {
+          sums_t.add(i, {pj->mass * grad, pj->mass * grad_sq, pj->mass * w->density_ratios(*pi)[pj->phase] * div});
+        }
+        if (!pj->boundary_particle) {
+          sums_t.add(pj->idx, {-pi->mass * grad, pi->mass * grad_sq, pi->mass * w->density_ratios(*pj)[pi->phase] * div});
+        }
+      }
+    }
+  }
+
+  DiagonalSums *total = w->scratch.alloc_array<DiagonalSums>(n);
+  sums.reduce(total);
+
+  double dt2 = dt * dt;
+  double alpha = 1.0;
+#pragma omp parallel for
+  for (Particle &p: w->particles) {
+    DiagonalSums &sum = total[p.idx];
+    aii[p.idx] = p.boundary_particle ? 0 : -dt2 / (p.rho * p.rho) * (p.mass * sum.grad_sq + norm_square(sum.inner));
+    if (!aii[p.idx]) continue;
+    double rho_0 = w->rest_density(p);
+    double density_correction = alpha * std::min(0.0, (rho_0 - p.rho));
+    double velocity_correction = dt * rho_0 * sum.div / p.rho;
+    s[p.idx] = density_correction + velocity_correction;
+  }
+}
+
+// (∇²p)ᵢ of the particles with aᵢᵢ != 0 over the half neighbour list
+void iisph_pressure_laplacian_symmetric(World *w, double *aii, vec *acc, double *laplacian, PairSums<double> &sums) {
+  sums.clear();
+#pragma omp parallel
+  {
+    PairSums<double>::Local laplacian_t = sums.local();
+    for (size_t i = laplacian_t.begin; i < laplacian_t.end; i++) {
+      Particle *pi = &w->particles[i];
+      for (Particle *pj: w->grid->get_half_neighbours(pi)) {
+        if (!aii[pi->idx] && !aii[pj->idx]) continue;
+        if (distance(pi->pos, pj->pos) >= SUPPORT_RADIUS) continue;
+
+        double term = dot(acc[pi->idx] - acc[pj->idx], gradW(pi->pos, pj->pos));
+        if (aii[pi->idx]) laplacian_t.add(i, pj->mass * term);
+        if (aii[pj->idx]) laplacian_t.add(pj->idx, pi->mass * term);
+      }
+    }
+  }
+  sums.reduce(laplacian);
+}
+
+// (∇²p)ᵢ of the particles with aᵢᵢ != 0 through CellTile
+void iisph_pressure_laplacian_tiled(World *w, double *aii, vec *acc, double *laplacian) {
+  const std::vector<GridBox*> &boxes = w->grid->get_hash_map()->used_boxes();
+  const double h2 = SUPPORT_RADIUS * SUPPORT_RADIUS;
+  #pragma omp parallel
+  {
+    CellTile tile;
+    #pragma omp for schedule(dynamic, 16)
+    for (GridBox *box: boxes) {
+      tile.gather(w->grid, box);
+      tile.gather_vec(acc);
+      for (int i = 0; i < tile.n_cell; i++) {
+        Particle *pi = tile.particles[i];
+        if (!aii[pi->idx]) continue;
+        tile.distances_sq(i);
+        vec acc_i = tile.vector(i);
+        double laplacian_i = 0.0;
+        for (int k = 0; k < tile.n; k++) {
+          if (tile.r2[k] >= h2) continue;
+          laplacian_i += tile.mass[k] * dot(acc_i - tile.vector(k), gradW(pi->pos, tile.position(k)));
+        }
+        laplacian[pi->idx] = laplacian_i;
+      }
+    }
+  }
+}
+
+// (∇²p)ᵢ of the particles with aᵢᵢ != 0, with the buffers of all modes
+class PressureLaplacian {
+  World *w;
+  double *aii;
+  vec *acc;
+  PairSums<vec> acc_sums;
+  PairSums<double> laplacian_sums;
+
+public:
+  PressureLaplacian(World *_w, double *_aii)
+    : w(_w), aii(_aii),
+      acc_sums(_w->scratch, _w->symmetric ? _w->particles.size() : 0),
+      laplacian_sums(_w->scratch, _w->symmetric ? _w->particles.size() : 0) {
+    acc = w->scratch.alloc_array<vec>(w->particles.size());
+    #pragma omp parallel for
+    for (Particle &p: w->particles) {
+      if (!aii[p.idx]) acc[p.idx] = {0};
+    }
+  }
+
+  void apply(double *P, double *laplacian) {
+    // Compute pressure acceleration (i.e. acc = -∇p/ρ)
+    if (w->tiled) {
+      pressure_accelerations_tiled(w, P, acc, aii);
+      iisph_pressure_laplacian_tiled(w, aii, acc, laplacian);
+      return;
+    }
+    if (w->symmetric) {
+      pressure_accelerations_symmetric(w, P, acc, acc_sums);
+      iisph_pressure_laplacian_symmetric(w, aii, acc, laplacian, laplacian_sums);
+      return;
+    }
+
+    #pragma omp parallel for
+    for (Particle &p : w->particles) {
+      if (!aii[p.idx]) continue;
+      acc[p.idx] = pressure_acceleration(w, &p, P);
+    }
+    #pragma omp parallel for
+    for (Particle& p: w->particles) {
+      if (!aii[p.idx]) continue;
+      // Compute (∇²p)ᵢ = -∇(ρ acc)
+      //               = ∑ⱼ mⱼ (accᵢ - accⱼ) · ∇W_{ij}
+      double laplacian_i = 0.0;
+      for (Particle* pj: w->grid->get_neighbours(&p)) {
+        laplacian_i += pj->mass * dot(acc[p.idx] - acc[pj->idx], gradW(p.pos, pj->pos));
+      }
+      laplacian[p.idx] = laplacian_i;
+    }
+  }
+};
+
+// One relaxed Jacobi sweep P_i <- P_i + Ω/aii (sᵢ - (Ap)ᵢ) with the
+// laplacian of the current P. Returns ∑ |sᵢ - (Ap)ᵢ|
+double iisph_jacobi_update(World *w, double dt2, double *aii, double *s, double *laplacian, double *P) {
+  double omega = w->pressure_omega;
+  double error = 0.0;
+  #pragma omp parallel for reduction(+: error)
+  for (Particle& p: w->particles) {
+    if (!aii[p.idx]) continue;
+    double s_minus_Ap_i = s[p.idx] - dt2 * laplacian[p.idx];
+    assert(aii[p.idx] != 0);
+    P[p.idx] = std::max(0.0, P[p.idx] + omega / aii[p.idx] * s_minus_Ap_i);
+    assert(!std::isnan(P[p.idx]));
+    error += std::abs(s_minus_Ap_i);
+  }
+  return error;
+}
+
+void iisph_compute_pressure(double dt, World *w, double *P, PressureMultigrid *multigrid) {
   // Use Jacobi iteration to solve a weighted average pressure poission equation
   //   To correct density deviation
   //       ∇²p = (ρ₀ - ρ*) / dt^2
   //   To correct velocity divergence
   //       ∇²p = ρ₀ (∇ . v) / dt
   //  Combining both these:
-  //   dt^2 ∇²p = α (ρ₀ - ρ*) + dt ρ ∇ . v
+  //   dt^2 ∇²p = α (ρ₀ - ρ) + dt ρ ∇ . v
+  //  (The divergence term already accounts for the density change over dt,
+  //   so the density term uses the current density instead of ρ*)
   // or,    A p = s
   // which is a sparse linear system with n variables (p_i) and n equations
 
@@ -34,57 +218,61 @@ void iisph_compute_pressure(double dt, World *w, double *P) {
 
   // Compute a_ii
   // particles with aii = 0 are excluded from computation
-  std::unique_ptr<double[]> aii(new double[w->particles.size()]);
-  std::unique_ptr<double[]> s(new double[w->particles.size()]);
+  double *aii = w->scratch.alloc_array<double>(w->particles.size());
+  double *s = w->scratch.alloc_array<double>(w->particles.size());
 
+  if (w->symmetric) {
+    iisph_compute_diagonal_symmetric(dt, w, aii, s);
+  } else {
 #pragma omp parallel
-  {
+    {
 #pragma omp for nowait
-    for (Particle& p: w->particles) {
-      if (p.boundary_particle) {
-        aii[p.idx] = 0;
-        continue;
-      }
+      for (Particle& p: w->particles) {
+        if (p.boundary_particle) {
+          aii[p.idx] = 0;
+          continue;
+        }
 
-      Particle *pi = &p;
-      // Δt²     ∑ⱼ mⱼ  [-∑ₖ mₖ / ρᵢ² ∇W_{ik} + mᵢ / ρᵢ² ∇W_{ji} ] . ∇W_{ij}
-      // -Δt²/ρᵢ² ∑ⱼ mⱼ  [ ∑ₖ mₖ      ∇W_{ik} + mᵢ      ∇W_{ij} ] . ∇W_{ij}
-      // -Δt²/ρᵢ² ∑ⱼ mⱼ  [ mᵢ ∇W_{ij}    + ∑ₖ mₖ ∇W_{ik}  ] . ∇W_{ij}
-      //                                -- (inner sum) --
-      //               -------- ( middle term )  --------
-      //         (outer sum)
+        Particle *pi = &p;
+        // Δt²     ∑ⱼ mⱼ  [-∑ₖ mₖ / ρᵢ² ∇W_{ik} + mᵢ / ρᵢ² ∇W_{ji} ] . ∇W_{ij}
+        // -Δt²/ρᵢ² ∑ⱼ mⱼ  [ ∑ₖ mₖ      ∇W_{ik} + mᵢ      ∇W_{ij} ] . ∇W_{ij}
+        // -Δt²/ρᵢ² ∑ⱼ mⱼ  [ mᵢ ∇W_{ij}    + ∑ₖ mₖ ∇W_{ik}  ] . ∇W_{ij}
+        //                                -- (inner sum) --
+        //               -------- ( middle term )  --------
+        //         (outer sum)
 
-      double outer_sum = 0;
+        double outer_sum = 0;
 
-      vec2 inner_sum = {0};
-      for (Particle* pk: w->grid->get_neighbours(pi)) {
-        inner_sum += pk->mass * gradW(pi->pos, pk->pos);
-      }
+        vec inner_sum = {0};
+        for (Particle* pk: w->grid->get_neighbours(pi)) {
+          inner_sum += pk->mass * gradW(pi->pos, pk->pos);
+        }
 
-      for (Particle* pj: w->grid->get_neighbours(pi)) {
-        vec2 middle_term = pi->mass * gradW(pi->pos, pj->pos) + inner_sum;
-        outer_sum = outer_sum + pj->mass * dot(middle_term, gradW(pi->pos, pj->pos));
-      }
+        for (Particle* pj: w->grid->get_neighbours(pi)) {
+          vec middle_term = pi->mass * gradW(pi->pos, pj->pos) + inner_sum;
+          outer_sum = outer_sum + pj->mass * dot(middle_term, gradW(pi->pos, pj->pos));
+        }
 
-      aii[pi->idx] = -dt2 / pow(pi->rho, 2) * outer_sum;
-    }
+        aii[pi->idx] = -dt2 / pow(pi->rho, 2) * outer_sum;
+      }
 
-    // Compute s_i
-    double alpha = 0.01;
+      // Compute s_i
+      double alpha = 1.0;
 #pragma omp for nowait
-    for (Particle& p: w->particles) {
-      if (!aii[p.idx]) continue;
-      double density_prediction = p.rho + dt * density_derivative(w, &p);
-      double density_correction = alpha * std::min(0.0, (w->rho_0 - density_prediction));
-      double velocity_correction =  dt * w->rho_0 * velocity_divergence(w, &p);
-      s[p.idx] = density_correction + velocity_correction;
+      for (Particle& p: w->particles) {
+        if (!aii[p.idx]) continue;
+        double rho_0 = w->rest_density(p);
+        double density_correction = alpha * std::min(0.0, (rho_0 - p.rho));
+        double velocity_correction =  dt * rho_0 * velocity_divergence(w, &p);
+        s[p.idx] = density_correction + velocity_correction;
+      }
     }
+  }
 
-    // Initialize P_i = 0
-#pragma omp for
-    for (int i = 0; i < w->particles.size(); i++) {
-      P[i] = 0;
-    }
+  // Initialize P_i = 0
+#pragma omp parallel for
+  for (size_t i = 0; i < w->particles.size(); i++) {
+    P[i] = 0;
   }
 
   // Jacobi Iteration to solve
@@ -92,59 +280,119 @@ void iisph_compute_pressure(double dt, World *w, double *P) {
   // or,     A p = s
   // P_i <- P_i + Ω/aii (sᵢ - (Ap)ᵢ)
   // until average Ap - s is within tolerance
-
-  // Initialize pressure acceleration
-  std::unique_ptr<vec2[]> acc(new vec2[w->particles.size()]);
   int n_fluid = 0;
   #pragma omp parallel for reduction(+: n_fluid)
   for (Particle &p: w->particles) {
-    if (!aii[p.idx]) {
-      acc[p.idx] = {0};
-    } else {
-      n_fluid++;
-    }
+    if (aii[p.idx]) n_fluid++;
   }
-  //printf("n_fluid : %d\n", n_fluid);
 
-  double omega = 0.5; // Relaxed Jacobi iteration
   double error;
-  double alpha = 0.01;
-  double tolerance = alpha * n_fluid * 0.001 * w->rho_0; // 0.1% of ρ₀
+  double alpha = 1.0;
+  double tolerance = alpha * n_fluid * w->tolerance * w->rho_0; // Relative to ρ₀
   int iters = 0;
-  do {
-    error = 0.0;
-    iters++;
-    // Compute pressure acceleration (i.e. acc = -∇p/ρ)
-    #pragma omp parallel for
-    for (Particle &p : w->particles) {
-      if (!aii[p.idx]) continue;
-      acc[p.idx] = pressure_acceleration(w, &p, P);
-    }
+  int applies = 0; // Of the particles' operator A, the cost comparable between the solvers
+  PressureLaplacian A(w, aii);
+  double *laplacian = w->scratch.alloc_array<double>(w->particles.size());
 
-    #pragma omp parallel for reduction(+: error)
-    for (Particle& p: w->particles) {
-      if (!aii[p.idx]) continue;
-      // Compute (∇²p)ᵢ = -∇(ρ acc)
-      //               = ∑ⱼ mⱼ (accᵢ - accⱼ) · ∇W_{ij}
-      double laplacian_i = 0.0; // Pressure laplacian
-      for (Particle* pj: w->grid->get_neighbours(&p)) {
-        laplacian_i += pj->mass * dot(acc[p.idx] - acc[pj->idx], gradW(p.pos, pj->pos));
+  int cycles = 0;
+  bool stalled = false;
+  if (multigrid) {
+    // Each cycle: coarse grid correction e of the residual r, scaled by the
+    // step minimizing |r - α A e|, then Jacobi sweeps for the error the
+    // cell aggregates cannot represent. A cycle applies A four times and
+    // runs a V-cycle over the coarse levels, so its iterations are not those
+    // of the Jacobi iteration above; compare PPE Applies or the time of
+    // Compute Pressure instead.
+    size_t n = w->particles.size();
+    double *r = w->scratch.alloc_array<double>(n);
+    double *e = w->scratch.alloc_array<double>(n);
+    double *q = w->scratch.alloc_array<double>(n);
+    // Particles held at P = 0 by the clamp, whose residual asks for a
+    // negative pressure, are left out of the coarse correction. Otherwise
+    // it pulls their aggregates' pressure down, the clamp undoes it, and
+    // the cycles stall short of the tolerance.
+    bool *held = w->scratch.alloc_array<bool>(n);
+    double last_error = 0.0;
+    while (true) {
+      cycles++;
+      A.apply(P, laplacian);
+      applies++;
+      error = 0.0;
+      #pragma omp parallel for reduction(+: error)
+      for (Particle &p: w->particles) {
+        r[p.idx] = aii[p.idx] ? s[p.idx] - dt2 * laplacian[p.idx] : 0.0;
+        error += std::abs(r[p.idx]);
+        held[p.idx] = aii[p.idx] && P[p.idx] == 0 && r[p.idx] / aii[p.idx] < 0;
+        if (held[p.idx]) r[p.idx] = 0.0;
+      }
+      if (error < tolerance || cycles > w->max_pressure_iters) break;
+      if (cycles > 1 && error > MG_MIN_REDUCTION * last_error) {
+        stalled = true;
+        break;
+      }
+      last_error = error;
+      if (cycles == 1) {
+        // Only set up when the initial pressure is not already good enough
+        w->timer_start("MG Setup");
+        multigrid->setup(w, dt2, aii);
+        w->timer_end("MG Setup");
+        w->log("MG Levels", multigrid->n_levels());
+      }
+
+      multigrid->solve(w, r, e);
+      A.apply(e, q);
+      applies++;
+      double rq = 0.0, qq = 0.0;
+      #pragma omp parallel for reduction(+: rq, qq)
+      for (Particle &p: w->particles) {
+        if (!aii[p.idx] || held[p.idx]) continue;
+        rq += r[p.idx] * dt2 * q[p.idx];
+        qq += dt2 * q[p.idx] * dt2 * q[p.idx];
+      }
+      double step = qq > 0 ? rq / qq : 0.0;
+      #pragma omp parallel for
+      for (Particle &p: w->particles) {
+        if (aii[p.idx] && !held[p.idx]) P[p.idx] = std::max(0.0, P[p.idx] + step * e[p.idx]);
+      }
+
+      for (int sweep = 0; sweep < 2; sweep++) {
+        A.apply(P, laplacian);
+        applies++;
+        iisph_jacobi_update(w, dt2, aii, s, laplacian, P);
       }
-      // Update P_i <- P_i + Ω/aii (sᵢ - (Ap)ᵢ)
-      double s_minus_Ap_i = s[p.idx] - dt2 * laplacian_i;
-      assert(aii[p.idx] != 0);
-      P[p.idx] = std::max(0.0, P[p.idx] + omega / aii[p.idx] * s_minus_Ap_i);
-      assert(!std::isnan(P[p.idx]));
-      error += abs(s_minus_Ap_i);
     }
+  }
 
-    //printf("[%d] %f >= %f\n", iters, error, tolerance);
-  } while (error >= tolerance && iters <= 100);
-  w->log("PPE Iters", iters);
+  // Plain IISPH, or Jacobi taking over from cycles that stopped reducing
+  // the residual
+  if (!multigrid || stalled) {
+    do {
+      iters++;
+      A.apply(P, laplacian);
+      applies++;
+      error = iisph_jacobi_update(w, dt2, aii, s, laplacian, P);
+    } while (error >= tolerance && cycles + iters <= w->max_pressure_iters);
+  }
+  if (multigrid) w->log("MG Cycles", cycles);
+  if (!multigrid || stalled) w->log("PPE Iters", iters);
+  w->log("PPE Applies", applies);
   w->log("PPE Error", error);
   w->log("PPE Active", n_fluid);
 }
 
+IISPH::IISPH(bool multigrid) {
+  if (multigrid) this->multigrid = new PressureMultigrid();
+}
+
+IISPH::~IISPH() {
+  if (pressure) first_touch_free(pressure);
+  delete multigrid;
+}
+
+void IISPH::particles_changed(const std::vector<int> &old_index) {
+  remap_particle_array(pressure, capacity, old_index);
+}
+
 double *IISPH::get_pressure() {
   return pressure;
 }
@@ -152,15 +400,12 @@ double *IISPH::get_pressure() {
 double IISPH::physics_update() {
   // Update neighbours
   w->timer_start("Build Grid");
-  w->grid->build();
+  w->update_neighbours();
   w->timer_end("Build Grid");
 
   // Compute density
   w->timer_start("Compute Density");
-  #pragma omp parallel for
-  for (Particle& p: w->particles) {
-    p.rho = compute_density(w, &p);
-  }
+  compute_density_and_forces(w);
   w->timer_end("Compute Density");
 
   w->timer_start("dt,F_nonp");
@@ -172,23 +417,32 @@ double IISPH::physics_update() {
   #pragma omp parallel for
   for (Particle& p: w->particles) {
     if (!p.boundary_particle) {
-      p.vel += dt * (w->viscous_acceleration(p) + w->external_acceleration(p));
+      p.vel += dt * (w->viscous_acceleration(p) + w->external_acceleration(p)) + w->xsph_correction(p);
     }
   }
   w->timer_end("dt,F_nonp");
 
   // Compute pressure forces
   w->timer_start("Compute Pressure");
-  iisph_compute_pressure(dt, w, pressure);
+  iisph_compute_pressure(dt, w, pressure, multigrid);
   w->timer_end("Compute Pressure");
 
   w->timer_start("Apply forces");
   // Apply pressure acceleration
   // Dv/Dt = -1/ρ ∇p
+  vec *acc = nullptr;
+  if (w->tiled) {
+    acc = w->scratch.alloc_array<vec>(w->particles.size());
+    pressure_accelerations_tiled(w, pressure, acc, nullptr);
+  } else if (w->symmetric) {
+    acc = w->scratch.alloc_array<vec>(w->particles.size());
+    PairSums<vec> acc_sums(w->scratch, w->particles.size());
+    pressure_accelerations_symmetric(w, pressure, acc, acc_sums);
+  }
   #pragma omp parallel for
   for (Particle& p: w->particles) {
     if (!p.boundary_particle) {
-      p.vel += dt * pressure_acceleration(w, &p, pressure);
+      p.vel += dt * (acc ? acc[p.idx] : pressure_acceleration(w, &p, pressure));
     }
   }
 
@@ -207,5 +461,6 @@ double IISPH::physics_update() {
 
 void IISPH::initialize(World *_w) {
   w = _w;
-  pressure = new double[w->particles.size()];
+  capacity = w->particles.size();
+  pressure = first_touch_array<double>(capacity);
 }
@@ -3,14 +3,22 @@
 
 #include "types.h"
 
+class PressureMultigrid;
+
 class IISPH: public Algorithm {
 private:
-  double *pressure;
+  double *pressure = nullptr;
+  size_t capacity;
   World *w;
+  PressureMultigrid *multigrid = nullptr;
 
 public:
+  // multigrid: solve the pressure equation with coarse grid corrections
+  IISPH(bool multigrid = false);
+  ~IISPH();
   virtual double *get_pressure();
   virtual void initialize(World *w);
   virtual double physics_update();
+  virtual void particles_changed(const std::vector<int> &old_index);
 };
 #endif
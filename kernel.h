@@ -1,8 +1,79 @@
 #ifndef __KERNEL
 #define __KERNEL
 
-double W(double r);
-double dW_dr(double r);
-vec2 gradW(vec2 p1, vec2 p2);
-double gradW_norm(vec2 p1, vec2 p2);
+#include "types.h"
+#include <cmath>
+#include <cassert>
+
+// Kernel functions are called in every neighbour loop, so they are defined
+// here to be inlined into the callers.
+
+#if SPH_DIM == 3
+const double KERNEL_NORMALIZATION = 8.0 / (PI * SUPPORT_RADIUS * SUPPORT_RADIUS * SUPPORT_RADIUS);
+#else
+const double KERNEL_NORMALIZATION = 40.0 / (7.0 * PI * SUPPORT_RADIUS * SUPPORT_RADIUS);
+#endif
+
+// Kernel Function
+inline double cubic_spline(double r) {
+  const double normalization = KERNEL_NORMALIZATION;
+  float q = r / SUPPORT_RADIUS;
+
+  if (0 <= q && q <= 0.5)
+    return normalization * (1 - 6 * q * q * (1 - q));
+  else if (0.5 <= q && q <= 1)
+    return normalization * 2 * (1 - q) * (1 - q) * (1 - q);
+
+  return 0.0;
+}
+
+inline double W(double r) {
+  double w = cubic_spline(r);
+  assert(w >= 0);
+  return w;
+}
+
+// First derivative of Kernel function W(r)
+inline double dW_dr(double r) {
+  const double normalization = KERNEL_NORMALIZATION / SUPPORT_RADIUS;
+  double q = r / SUPPORT_RADIUS;
+
+  if (0 <= q && q <= 0.5)
+    return normalization * 6 * q * (3 * q - 2);
+  else if (0.5 <= q && q <= 1)
+    return normalization * -6 * (1 - q) * (1 - q);
+
+  return 0.0;
+}
+
+inline vec gradW(vec p1, vec p2) {
+  vec r = p1 - p2;
+  double rnorm = norm(r);
+
+  if (rnorm < 1e-8) {
+    vec result = {0};
+    return result;
+  }
+  return r * (dW_dr(rnorm) / rnorm);
+}
+
+inline double gradW_norm(vec p1, vec p2) {
+   return dW_dr(norm(p1 - p2));
+}
+
+// Cohesion kernel of Akinci et al. 2013, repulsive below h/2
+inline double cohesion_kernel(double r) {
+  const double h = SUPPORT_RADIUS;
+  const double h3 = h * h * h;
+  const double normalization = 32.0 / (PI * h3 * h3 * h3);
+
+  if (r <= 0 || r > h)
+    return 0.0;
+  double c = (h - r) * r;
+  if (2 * r > h)
+    return normalization * c * c * c;
+  else
+    return normalization * (2 * c * c * c - h3 * h3 / 64);
+}
+
 #endif
@@ -0,0 +1,158 @@
+#include "live.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+LiveSlot *live_slot(char *mem, LiveHeader *header, uint64_t frame) {
+  return (LiveSlot *)(mem + header->slots_offset + (frame % header->slots) * header->slot_bytes);
+}
+
+LivePublisher::LivePublisher(std::string _name, World *w) {
+  name = "/sph_" + _name;
+  size_t capacity = w->particles.size();
+  if (w->max_particles > 0) capacity = std::max(capacity, w->max_particles);
+  else if (w->emitters.size() > 0) capacity *= 2;
+  size_t slots_offset = (sizeof(LiveHeader) + 63) / 64 * 64;
+  size_t slot_bytes = (sizeof(LiveSlot) + capacity * (SPH_DIM * sizeof(float) + 2) + 63) / 64 * 64;
+  bytes = slots_offset + LIVE_SLOTS * slot_bytes;
+  truncated = false;
+
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0 || ftruncate(fd, bytes) != 0) {
+    std::cerr << "Couldn't create shared memory " << name << std::endl;
+    exit(1);
+  }
+  mem = (char *) mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    std::cerr << "Couldn't map shared memory " << name << std::endl;
+    exit(1);
+  }
+
+  header = new (mem) LiveHeader;
+  header->magic = LIVE_MAGIC;
+  header->capacity = capacity;
+  header->dim = SPH_DIM;
+  header->slots = LIVE_SLOTS;
+  header->slots_offset = slots_offset;
+  header->slot_bytes = slot_bytes;
+  header->published.store(0);
+  header->closed.store(0);
+
+  for (int k = 0; k < LIVE_SLOTS; k++) {
+    new (live_slot(mem, header, k)) LiveSlot;
+    live_slot(mem, header, k)->seq.store(0);
+  }
+  printf("Publishing frames to shared memory %s\n", name.c_str());
+}
+
+LivePublisher::~LivePublisher() {
+  header->closed.store(1, std::memory_order_release);
+  munmap(mem, bytes);
+  shm_unlink(name.c_str());
+}
+
+void LivePublisher::publish(World *w) {
+  uint64_t k = header->published.load(std::memory_order_relaxed);
+  LiveSlot *slot = live_slot(mem, header, k);
+  float *pos = (float *)(slot + 1);
+  char *symbols = (char *)(pos + header->capacity * SPH_DIM);
+  uint8_t *boundary = (uint8_t *)(symbols + header->capacity);
+
+  uint32_t n = std::min(w->particles.size(), (size_t) header->capacity);
+  if (n < w->particles.size() && !truncated) {
+    std::cerr << "Live frames hold only " << n << " particles, set --max-particles" << std::endl;
+    truncated = true;
+  }
+
+  slot->seq.store(2 * k + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot->time = w->time;
+  slot->n = n;
+  for (uint32_t i = 0; i < n; i++) {
+    Particle &p = w->particles[i];
+    pos[i * SPH_DIM] = p.pos.x;
+    pos[i * SPH_DIM + 1] = p.pos.y;
+#if SPH_DIM == 3
+    pos[i * SPH_DIM + 2] = p.pos.z;
+#endif
+    symbols[i] = p.symbol;
+    boundary[i] = p.boundary_particle;
+  }
+  slot->seq.store(2 * k + 2, std::memory_order_release);
+  header->published.store(k + 1, std::memory_order_release);
+}
+
+LiveReader::LiveReader(std::string _name) {
+  std::string name = "/sph_" + _name;
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(LiveHeader)) {
+    std::cerr << "No simulation is publishing to " << name << " (run the simulator with --live " << _name << ")" << std::endl;
+    exit(1);
+  }
+  bytes = st.st_size;
+  mem = (char *) mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    std::cerr << "Couldn't map shared memory " << name << std::endl;
+    exit(1);
+  }
+
+  header = (LiveHeader *) mem;
+  if (header->magic != LIVE_MAGIC) {
+    std::cerr << name << " is not a simulation frame buffer" << std::endl;
+    exit(1);
+  }
+  n = 0;
+  dim = header->dim;
+  last_read = 0;
+}
+
+LiveReader::~LiveReader() {
+  munmap(mem, bytes);
+}
+
+bool LiveReader::latest(std::vector<float> &pos, double &time, uint64_t &frame) {
+  // A few attempts, the writer only overtakes a reader that is LIVE_SLOTS
+  // frames behind
+  for (int attempt = 0; attempt < 8; attempt++) {
+    uint64_t published = header->published.load(std::memory_order_acquire);
+    if (published == 0 || published == last_read) return false;
+
+    uint64_t k = published - 1;
+    LiveSlot *slot = live_slot(mem, header, k);
+    uint64_t seq = slot->seq.load(std::memory_order_acquire);
+    if (seq != 2 * k + 2) continue;
+
+    const float *slot_pos = (const float *)(slot + 1);
+    const char *slot_symbols = (const char *)(slot_pos + header->capacity * dim);
+    const uint8_t *slot_boundary = (const uint8_t *)(slot_symbols + header->capacity);
+    uint32_t slot_n = std::min(slot->n, header->capacity);
+    time = slot->time;
+    pos.resize(slot_n * dim);
+    symbols.resize(slot_n);
+    boundary.resize(slot_n);
+    memcpy(pos.data(), slot_pos, slot_n * dim * sizeof(float));
+    memcpy(symbols.data(), slot_symbols, slot_n);
+    memcpy(boundary.data(), slot_boundary, slot_n);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->seq.load(std::memory_order_relaxed) != seq) continue;
+
+    n = slot_n;
+    last_read = published;
+    frame = k;
+    return true;
+  }
+  return false;
+}
+
+bool LiveReader::closed() {
+  return header->closed.load(std::memory_order_acquire);
+}
@@ -0,0 +1,77 @@
+#ifndef __SPH_LIVE
+#define __SPH_LIVE
+
+#include "types.h"
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Frames published to a POSIX shared memory segment for a viewer process.
+// The segment is a ring of LIVE_SLOTS frames each guarded by a sequence
+// number (seqlock): the simulator never waits for readers, and a reader
+// that raced with a write just retries or takes the next frame.
+//
+// Layout: LiveHeader | slots
+// Slot:   LiveSlot | capacity * dim floats of positions | capacity symbols
+//         | capacity boundary bytes
+// Each frame holds its own particle count since emitters and sinks change it.
+
+const uint32_t LIVE_MAGIC = 0x53504832; // "SPH2"
+const int LIVE_SLOTS = 4;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t capacity; // Particles a slot can hold
+  uint32_t dim;
+  uint32_t slots;
+  uint64_t slots_offset;
+  uint64_t slot_bytes;
+  std::atomic<uint64_t> published; // Frames published so far
+  std::atomic<uint32_t> closed;    // Set when the simulator exits
+} LiveHeader;
+
+typedef struct {
+  std::atomic<uint64_t> seq; // 2k + 1 while frame k is written, 2k + 2 after
+  double time;
+  uint32_t n;
+} LiveSlot;
+
+class LivePublisher {
+  std::string name;
+  char *mem;
+  size_t bytes;
+  LiveHeader *header;
+  bool truncated;
+
+public:
+  // Creates the segment /sph_<name>, replacing a stale one. It holds
+  // w->max_particles particles, or twice the current ones if the world has
+  // emitters and no limit, further particles aren't published.
+  LivePublisher(std::string name, World *w);
+  ~LivePublisher();
+  void publish(World *w);
+};
+
+class LiveReader {
+  char *mem;
+  size_t bytes;
+  LiveHeader *header;
+  uint64_t last_read;
+
+public:
+  uint32_t n; // Of the last frame read
+  uint32_t dim;
+  std::vector<char> symbols;
+  std::vector<uint8_t> boundary;
+
+  // Attaches to /sph_<name>, exits if the simulator isn't running
+  LiveReader(std::string name);
+  ~LiveReader();
+  // Copies the newest frame into pos, symbols and boundary if it wasn't read
+  // before
+  bool latest(std::vector<float> &pos, double &time, uint64_t &frame);
+  bool closed();
+};
+
+#endif
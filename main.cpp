@@ -3,44 +3,21 @@
 #include <fstream>
 #include <algorithm>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <vector>
 #include "vec2.h"
 #include "types.h"
-#include "kernel.h"
-#include "iisph.h"
+#include "affinity.h"
+#include "live.h"
+#include "sweep.h"
+#include "analysis.h"
+#include "surface.h"
+#include "tasks.h"
+#include "perf.h"
+#include "autotune.h"
 #include <omp.h>
 
-void setup_initial_mass(World *world) {
-  // Compute initial mass
-  for (Particle &p : world->particles) {
-    double sumW = W(0);
-    for (Particle *np: world->grid->get_neighbours(&p)) {
-      sumW += W(distance(p.pos, np->pos));
-    }
-    p.mass = world->rho_0 / sumW;
-    assert(p.mass >= 0);
-  }
-}
-
-World *initialize_world(std::string filename, int parsing_scale) {
-  std::vector<Particle> particles = parse_input_file(filename, parsing_scale);
-  IISPH *algorithm = new IISPH();
-  World *w = new World(particles, algorithm);
-  int fluid_cout = std::count_if(w->particles.begin(), w->particles.end(), [](Particle& p) { return !p.boundary_particle; });
-  printf("World loaded [%zu particles] [%d Fluid] \n", w->particles.size(), fluid_cout);
-  #pragma omp parallel
-  {
-    #pragma omp single
-    printf("OMP_NUM_THREADS=%d\n", omp_get_num_threads());
-  }
-  w->grid->build();
-  setup_initial_mass(w);
-  w->alg->initialize(w);
-  return w;
-}
-
-
 typedef struct {
   std::string input_filename;
   std::string output_filename;
@@ -50,7 +27,42 @@ typedef struct {
   bool data_file_out;
   bool terminal_render;
   int parsing_scale;
+  int depth;
+  std::string solver;
+  double sound_speed;
+  vec gravity;
+  double viscosity;
+  double xsph;
+  double surface_tension;
+  std::vector<Phase> phases;
+  bool symmetric;
+  bool tiled;
+  bool tasks;
+  bool health;
+  bool perf;
+  bool incremental_grid;
+  double health_density_error;
+  double health_velocity;
+  double skin;
   bool save_pressure;
+  uint8_t channels;
+  OutputSelection selection;
+  bool full_frames;
+  std::string affinity;
+  bool numa_report;
+  std::string live;
+  std::string sweep;
+  int threads_per_run;
+  std::string analysis;
+  std::string reductions;
+  std::string probes;
+  int analysis_every;
+  std::string surface;
+  double surface_resolution;
+  size_t max_particles;
+  bool autotune;
+  std::string autotune_cache;
+  int autotune_steps;
 } Params;
 
 std::string get_arg(std::vector<std::string> args, std::string param) {
@@ -80,8 +92,65 @@ void print_help() {
   cout << "                     Not used if --time is provided" << endl;
   cout << "--no-render        Disable rendering to terminal" << endl;
   cout << "--no-output        Don't save results to file" << endl;
+  cout << "--live         S   Publish frames to shared memory for out/viewer S" << endl;
+  cout << "--analysis     F   Save in-situ statistics to F (CSV if F ends in .csv, else binary)" << endl;
+  cout << "--reductions   L   Statistics to save, comma separated list of kinetic_energy," << endl;
+  cout << "                     density_error, max_density_error, max_velocity, surface_height" << endl;
+  cout << "                     (default all)" << endl;
+  cout << "--probes       F   Save pressure and density at the points (x y [z] per line) of F" << endl;
+  cout << "--analysis-every N Sample the statistics every N steps (default 1)" << endl;
+  cout << "--surface      F   Save the fluid surface (marching squares segments) to F (2D)" << endl;
+  cout << "--surface-resolution N  Surface grid cells per particle spacing (default 2)" << endl;
   cout << "--scale        N   Scale to use for Input file" << endl;
+  cout << "--depth        N   Extrude the scene over N characters along z (3D build, default 8)" << endl;
   cout << "--pressure         Save pressure values to output file" << endl;
+  cout << "--channels     L   Values saved with the positions, comma separated list of" << endl;
+  cout << "                     pressure, velocity and density" << endl;
+  cout << "--stride       N   Save every N-th fluid particle" << endl;
+  cout << "--roi  X0,Y0,X1,Y1 Save only the fluid particles inside this box" << endl;
+  cout << "--full-frames      Save all particles, boundary included, in every frame" << endl;
+  cout << "--solver       S   Pressure solver: iisph (default), iisph-mg (multigrid), dfsph or wcsph." << endl;
+  cout << "                     iisph-mg only pays off on deep, settled fluid (a tall column);" << endl;
+  cout << "                     on most scenes, and at tight tolerances, iisph is faster" << endl;
+  cout << "--sound-speed  N   Speed of sound for wcsph (default 30)" << endl;
+  cout << "--gravity    X,Y   Gravity (default 0,-9.81), z is 0 in 3D" << endl;
+  cout << "--viscosity    N   Kinematic viscosity (default 0)" << endl;
+  cout << "--xsph         N   XSPH velocity smoothing factor (default 0)" << endl;
+  cout << "--surface-tension N  Cohesion coefficient (default 0)" << endl;
+  cout << "--phase        L   Fluid phases of scene symbols, comma separated list of" << endl;
+  cout << "                     S:RHO[:NU] (rest density, kinematic viscosity), e.g. w:1000,o:850:0.01." << endl;
+  cout << "                     Other symbols are the default fluid (rest density 1000, --viscosity)" << endl;
+  cout << "--max-particles N  Pause the scene's emitters at N particles (default no limit)" << endl;
+  cout << "--symmetric        Evaluate each particle pair once (half neighbour list)" << endl;
+  cout << "--tiled            Traverse cell by cell over contiguous copies of the neighbour" << endl;
+  cout << "                     cells (density and IISPH pressure; not with --symmetric)" << endl;
+  cout << "--tasks            Overlap the frame output, rendering, publishing and analysis" << endl;
+  cout << "                     of a step with the next step's cell rebuild (task graph;" << endl;
+  cout << "                     with --skin or --incremental-grid the rebuild stays parallel)." << endl;
+  cout << "                     The solver's phases still run as parallel loops" << endl;
+  cout << "--health           Check every step for NaN, density error and speed, and roll" << endl;
+  cout << "                     back a failed step to retry it with half the max dt, doubled" << endl;
+  cout << "                     back every 10 healthy steps" << endl;
+  cout << "--health-density N Density error |ρ - ρ₀|/ρ₀ that fails a step (default 0.5)" << endl;
+  cout << "--health-velocity N  Speed that fails a step (default 50)" << endl;
+  cout << "--skin         N   Reuse a Verlet neighbour list of radius (1 + N)h until a" << endl;
+  cout << "                     particle moves N/2 h (0 to 1, default 0: rebuild every step)" << endl;
+  cout << "--perf             Report hardware counters (cycles, instructions, LLC and branch" << endl;
+  cout << "                     misses, stalled cycles) of each timed phase (Linux)" << endl;
+  cout << "--incremental-grid  Update the cells by moving only the particles that changed" << endl;
+  cout << "                     cells (full rebuild when more than 10% did). Only matters where" << endl;
+  cout << "                     the rebuild is a noticeable part of a step (see its Build Grid)" << endl;
+  cout << "--autotune         Tune the threads, cell size, hash map size and pressure solver" << endl;
+  cout << "                     relaxation on short runs of the scene, or reuse the tuning" << endl;
+  cout << "                     cached for this scene and machine" << endl;
+  cout << "--autotune-cache F File of cached tunings (default .sph_tuning)" << endl;
+  cout << "--autotune-steps N Timed steps of each tuning run (default 20)" << endl;
+  cout << "--affinity     P   Pin OpenMP threads to cpus (compact or spread)" << endl;
+  cout << "--numa-report      Report socket local vs remote memory bandwidth (local only" << endl;
+  cout << "                     on a single socket)" << endl;
+  cout << "--sweep        F   Run every configuration of sweep file F concurrently" << endl;
+  cout << "                     (simulator --sweep F [optional parameters])" << endl;
+  cout << "--threads-per-run N  OpenMP threads of each sweep run (default 1)" << endl;
   cout << "--help             Prints this help message." << endl;
 }
 
@@ -136,6 +205,55 @@ Params parse_args(int argc, char** argv) {
     params.parsing_scale = std::max(1, std::stoi(scale_str));
   }
 
+  std::string depth_str = get_arg(args, "--depth");
+  if (depth_str == "") {
+    params.depth = 8;
+  } else {
+    params.depth = std::max(1, std::stoi(depth_str));
+  }
+
+  params.solver = get_arg(args, "--solver");
+  if (params.solver == "") params.solver = "iisph";
+
+  std::string sound_speed_str = get_arg(args, "--sound-speed");
+  if (sound_speed_str == "") {
+    params.sound_speed = 30;
+  } else {
+    params.sound_speed = std::stod(sound_speed_str);
+  }
+
+  std::string gravity_str = get_arg(args, "--gravity");
+  if (gravity_str == "") {
+    params.gravity = {0, -9.81};
+  } else {
+    size_t comma = gravity_str.find(',');
+    params.gravity = {0};
+    params.gravity.x = std::stod(gravity_str.substr(0, comma));
+    params.gravity.y = std::stod(gravity_str.substr(comma + 1));
+  }
+
+  std::string viscosity_str = get_arg(args, "--viscosity");
+  params.viscosity = viscosity_str == "" ? 0.0 : std::stod(viscosity_str);
+  std::string xsph_str = get_arg(args, "--xsph");
+  params.xsph = xsph_str == "" ? 0.0 : std::stod(xsph_str);
+  std::string surface_tension_str = get_arg(args, "--surface-tension");
+  params.surface_tension = surface_tension_str == "" ? 0.0 : std::stod(surface_tension_str);
+
+  std::stringstream phases(get_arg(args, "--phase"));
+  std::string phase;
+  while (std::getline(phases, phase, ',')) {
+    std::stringstream fields(phase);
+    std::string symbol, rho_0, viscosity;
+    std::getline(fields, symbol, ':');
+    std::getline(fields, rho_0, ':');
+    std::getline(fields, viscosity, ':');
+    if (symbol.size() != 1 || rho_0 == "" || std::stod(rho_0) <= 0) {
+      std::cerr << "--phase needs S:RHO[:NU] with a single character S and RHO > 0: " << phase << std::endl;
+      exit(1);
+    }
+    params.phases.push_back({symbol[0], std::stod(rho_0), viscosity == "" ? params.viscosity : std::stod(viscosity)});
+  }
+
   if (find_arg(args, "--no-render")) {
     params.terminal_render = false;
   } else {
@@ -154,8 +272,98 @@ Params parse_args(int argc, char** argv) {
     params.save_pressure = false;
   }
 
+  params.channels = params.save_pressure ? SIM_PRESSURE : 0;
+  std::stringstream channels(get_arg(args, "--channels"));
+  std::string channel;
+  while (std::getline(channels, channel, ',')) {
+    if (channel == "pressure") {
+      params.channels |= SIM_PRESSURE;
+    } else if (channel == "velocity") {
+      params.channels |= SIM_VELOCITY;
+    } else if (channel == "density") {
+      params.channels |= SIM_DENSITY;
+    } else {
+      std::cerr << "Unknown output channel: " << channel << std::endl;
+      exit(1);
+    }
+  }
+
+  std::string stride_str = get_arg(args, "--stride");
+  params.selection.stride = stride_str == "" ? 1 : std::max(1, std::stoi(stride_str));
+  std::string roi_str = get_arg(args, "--roi");
+  if (roi_str != "") {
+    double roi[4];
+    std::stringstream roi_stream(roi_str);
+    for (int i = 0; i < 4; i++) {
+      std::string value;
+      if (!std::getline(roi_stream, value, ',')) {
+        std::cerr << "--roi needs X0,Y0,X1,Y1" << std::endl;
+        exit(1);
+      }
+      roi[i] = std::stod(value);
+    }
+    params.selection.roi = true;
+    params.selection.roi_min = {0};
+    params.selection.roi_max = {0};
+    params.selection.roi_min.x = std::min(roi[0], roi[2]);
+    params.selection.roi_min.y = std::min(roi[1], roi[3]);
+    params.selection.roi_max.x = std::max(roi[0], roi[2]);
+    params.selection.roi_max.y = std::max(roi[1], roi[3]);
+  }
+  params.full_frames = find_arg(args, "--full-frames");
+
+  params.symmetric = find_arg(args, "--symmetric");
+  params.tiled = find_arg(args, "--tiled");
+  if (params.symmetric && params.tiled) {
+    std::cerr << "--symmetric and --tiled are different traversals, pick one" << std::endl;
+    exit(1);
+  }
+  params.tasks = find_arg(args, "--tasks");
+  params.health = find_arg(args, "--health");
+  params.perf = find_arg(args, "--perf");
+  params.incremental_grid = find_arg(args, "--incremental-grid");
+  std::string health_density_str = get_arg(args, "--health-density");
+  params.health_density_error = health_density_str == "" ? 0.5 : std::stod(health_density_str);
+  std::string health_velocity_str = get_arg(args, "--health-velocity");
+  params.health_velocity = health_velocity_str == "" ? 50.0 : std::stod(health_velocity_str);
+  std::string max_particles_str = get_arg(args, "--max-particles");
+  params.max_particles = max_particles_str == "" ? 0 : std::stoul(max_particles_str);
+  std::string skin_str = get_arg(args, "--skin");
+  params.skin = skin_str == "" ? 0.0 : std::stod(skin_str);
+  if (params.skin < 0 || params.skin > 1) {
+    std::cerr << "--skin must be between 0 and 1" << std::endl;
+    exit(1);
+  }
+  params.autotune = find_arg(args, "--autotune");
+  params.autotune_cache = get_arg(args, "--autotune-cache");
+  if (params.autotune_cache == "") params.autotune_cache = ".sph_tuning";
+  std::string autotune_steps_str = get_arg(args, "--autotune-steps");
+  params.autotune_steps = autotune_steps_str == "" ? 20 : std::max(1, std::stoi(autotune_steps_str));
+  params.affinity = get_arg(args, "--affinity");
+  params.numa_report = find_arg(args, "--numa-report");
+  params.live = get_arg(args, "--live");
+  params.sweep = get_arg(args, "--sweep");
+  params.analysis = get_arg(args, "--analysis");
+  params.reductions = get_arg(args, "--reductions");
+  if (params.reductions == "") params.reductions = "kinetic_energy,density_error,max_density_error,max_velocity,surface_height";
+  params.probes = get_arg(args, "--probes");
+  std::string analysis_every_str = get_arg(args, "--analysis-every");
+  params.analysis_every = analysis_every_str == "" ? 1 : std::max(1, std::stoi(analysis_every_str));
+  params.surface = get_arg(args, "--surface");
+  std::string surface_resolution_str = get_arg(args, "--surface-resolution");
+  params.surface_resolution = surface_resolution_str == "" ? 2.0 : std::stod(surface_resolution_str);
+  if (params.surface_resolution <= 0) {
+    std::cerr << "--surface-resolution must be positive" << std::endl;
+    exit(1);
+  }
+  std::string threads_per_run_str = get_arg(args, "--threads-per-run");
+  params.threads_per_run = threads_per_run_str == "" ? 1 : std::max(1, std::stoi(threads_per_run_str));
+
   params.output_filename = get_arg(args, "--output");
-  if (params.output_filename == "") {
+  if (params.output_filename == "" && params.sweep != "") {
+    // Prefix of the sweep's output files
+    params.output_filename = params.sweep;
+  } else if (params.output_filename == "") {
     std::string scale_str = "";
     if (params.parsing_scale != 1) {
       scale_str = "_" + std::to_string(params.parsing_scale);
@@ -169,12 +377,121 @@ Params parse_args(int argc, char** argv) {
   return params;
 }
 
+uint8_t output_flags(Params &params) {
+  return SIM_MASS | SIM_BOUNDARY | params.channels | (params.full_frames ? 0 : SIM_SELECTION);
+}
+
+bool ends_with(std::string str, std::string suffix) {
+  return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+Analysis *make_analysis(Params &params) {
+  if (params.analysis == "") return nullptr;
+  return new Analysis(params.reductions, params.probes, ends_with(params.analysis, ".csv"));
+}
+
+// Settings of the command line that apply to every world
+void configure_world(World *world, Params &params) {
+  world->selection = params.selection;
+  world->gravity = params.gravity;
+  world->viscosity = params.viscosity;
+  world->xsph = params.xsph;
+  world->surface_tension = params.surface_tension;
+  for (Phase &phase: params.phases) world->add_phase(phase);
+  world->symmetric = params.symmetric;
+  world->tiled = params.tiled;
+  world->health = params.health;
+  world->health_density_error = params.health_density_error;
+  world->health_velocity = params.health_velocity;
+  world->max_particles = params.max_particles;
+  world->grid->skin = params.skin * SUPPORT_RADIUS;
+  world->grid->incremental = params.incremental_grid;
+}
+
+// Cached tuning of the scene on this machine, tuned now if there's none
+Tuning find_tuning(Params &params) {
+  // Everything configure_world() sets that changes the cost of a step or
+  // what the trials accept as healthy
+  char buffer[512];
+  snprintf(buffer, sizeof(buffer), "dim=%d scale=%d depth=%d solver=%s sound_speed=%g gravity=%g,%g "
+           "viscosity=%g xsph=%g surface_tension=%g skin=%g symmetric=%d tiled=%d incremental=%d "
+           "max_particles=%zu health_limits=%g,%g",
+           SPH_DIM, params.parsing_scale, params.depth, params.solver.c_str(), params.sound_speed,
+           params.gravity.x, params.gravity.y, params.viscosity, params.xsph, params.surface_tension,
+           params.skin, params.symmetric, params.tiled, params.incremental_grid, params.max_particles,
+           params.health_density_error, params.health_velocity);
+  std::string settings = buffer;
+  for (Phase &phase: params.phases) {
+    snprintf(buffer, sizeof(buffer), " phase=%c:%g:%g", phase.symbol, phase.rho_0, phase.viscosity);
+    settings += buffer;
+  }
+  std::string key = tuning_key(params.input_filename, settings);
+  Tuning tuning;
+  if (load_tuning(params.autotune_cache, key, tuning)) {
+    printf("[Tune] Cached: %s\n", format_tuning(tuning).c_str());
+    return tuning;
+  }
+  auto make_world = [&params]() {
+    World *w = initialize_world(params.input_filename, params.parsing_scale, params.depth, params.solver, params.sound_speed, 1000.0, false);
+    configure_world(w, params);
+    return w;
+  };
+  tuning = autotune(make_world, params.solver, params.skin, params.autotune_steps);
+  save_tuning(params.autotune_cache, key, tuning);
+  return tuning;
+}
+
+void sweep(Params &params) {
+  SweepOptions options;
+  options.iters = params.iters;
+  options.target_time = params.target_time;
+  options.save_interval = params.save_interval;
+  options.data_file_out = params.data_file_out;
+  options.output_flags = output_flags(params);
+  options.output_prefix = params.output_filename;
+  options.threads_per_run = params.threads_per_run;
+  options.depth = params.depth;
+  options.sound_speed = params.sound_speed;
+  options.analysis = make_analysis(params);
+  options.analysis_filename = params.analysis;
+  options.analysis_every = params.analysis_every;
+  run_sweep(params.sweep, options, [&params](World *w) { configure_world(w, params); });
+}
+
 int main(int argc, char** argv) {
   std::chrono::time_point start_point = std::chrono::high_resolution_clock::now();
   // Read args
   Params params = parse_args(argc, argv);
+  // Pin threads before any particle data is first touched
+  if (params.affinity != "") pin_threads(params.affinity);
+  if (params.numa_report) print_numa_report();
   // Initialize
-  World *world = initialize_world(params.input_filename, params.parsing_scale);
+  if (params.sweep != "") {
+    sweep(params);
+    return 0;
+  }
+  Tuning tuning;
+  if (params.autotune) {
+    tuning = find_tuning(params);
+    // Particle data is first touched by the tuned threads
+    omp_set_num_threads(tuning.threads);
+  }
+  World *world = initialize_world(params.input_filename, params.parsing_scale, params.depth, params.solver, params.sound_speed, 1000.0, true);
+  configure_world(world, params);
+  for (size_t k = 1; k < world->phases.size(); k++) {
+    Phase &phase = world->phases[k];
+    int count = std::count_if(world->particles.begin(), world->particles.end(), [k](Particle &p) { return p.phase == k; });
+    printf("Phase %c [rho_0 %g] [viscosity %g] [%d particles]\n", phase.symbol, phase.rho_0, phase.viscosity, count);
+  }
+  if (params.autotune) apply_tuning(world, tuning);
+  if (params.perf) {
+    world->perf = new PerfCounters();
+    if (!world->perf->enabled()) {
+      delete world->perf;
+      world->perf = nullptr;
+    }
+  }
+  LivePublisher *live = params.live == "" ? nullptr : new LivePublisher(params.live, world);
   // Open output file
   std::ofstream file;
   if (params.data_file_out) {
@@ -183,46 +500,109 @@ int main(int argc, char** argv) {
       std::cerr << "Couldn't opern file to save state  file: " << params.output_filename << std::endl;
       exit(1);
     }
-    world->write_headers(file, SIM_MASS | SIM_BOUNDARY | ((params.save_pressure ? SIM_PRESSURE : 0)));
+    world->write_headers(file, output_flags(params));
+  }
+
+  Analysis *analysis = make_analysis(params);
+  std::ofstream analysis_file;
+  if (analysis) {
+    analysis_file.open(params.analysis, std::ios::binary);
+    if (!analysis_file) {
+      std::cerr << "Couldn't open analysis file: " << params.analysis << std::endl;
+      exit(1);
+    }
+    analysis->write_header(analysis_file);
+  }
+
+  SurfaceExtractor *surface = nullptr;
+  std::ofstream surface_file;
+  if (params.surface != "") {
+    surface = new SurfaceExtractor(world, params.surface_resolution, 0.5);
+    surface_file.open(params.surface, std::ios::binary);
+    if (!surface_file) {
+      std::cerr << "Couldn't open surface file: " << params.surface << std::endl;
+      exit(1);
+    }
+    surface->write_header(surface_file);
   }
 
   // Run simulation
+  // With --tasks the output of a step runs in the task graph of the next
+  // step, next to the cell rebuild. Outputs read the particles, and those
+  // that sample the cells (probes) read the grid too, so that they don't
+  // overlap with its rebuild.
+  TaskGraph *graph = params.tasks ? new TaskGraph() : nullptr;
+  auto output = [&](const char *name, const void *target, std::function<void()> body, bool reads_cells = false) {
+    if (graph) {
+      std::vector<const void *> in = {&world->particles};
+      if (reads_cells) in.push_back(world->grid);
+      graph->add(name, in, {target}, body);
+    } else {
+      world->timer_start(name);
+      body();
+      world->timer_end(name);
+    }
+  };
+
   int iters = 0;
   double t = world->time;
   while ((params.iters < 0 || (iters < params.iters)) &&
          (params.target_time < 0 || world->time < params.target_time)) {
     iters++;
-    world->physics_update();
+    world->physics_update(graph);
+
+    if (analysis && iters % params.analysis_every == 0) {
+      output("Analysis", &analysis_file, [&]() { analysis->sample(world, analysis_file); }, true);
+    }
 
     bool render_interval_ok = (world->time - t) > params.save_interval;
     if (render_interval_ok) t = world->time;
 
     if (render_interval_ok && params.terminal_render) {
-      world->timer_start("Render");
-      render_to_terminal(world);
-      world->timer_end("Render");
+      output("Render", stdout, [&]() { render_to_terminal(world); });
     }
 
     if (render_interval_ok) {
       world->print_timings();
+      world->print_logs();
+      if (graph) graph->print_timeline();
       std::chrono::duration duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start_point);
       printf("[Iters: %d/%d] [Time: %.4fs/%.2f] [Wall Time: %.4fs]\n", iters, params.iters, world->time, params.target_time, (double) duration.count() / 1000);
     }
 
+    if (render_interval_ok && live) {
+      output("Publish", live, [&]() { live->publish(world); });
+    }
+
     if (render_interval_ok && params.data_file_out) {
-      world->timer_start("Save Frame");
-      world->write_frame(file);
-      world->timer_start("Save Frame");
+      output("Save Frame", &file, [&]() { world->write_frame(file); });
+    }
+
+    // Samples the cells, so it isn't left to the graph where they're rebuilt
+    if (render_interval_ok && surface) {
+      world->timer_start("Surface");
+      surface->write_frame(world, surface_file);
+      world->timer_end("Surface");
     }
   }
+  if (graph && !graph->empty()) graph->run(world);
+  delete graph;
 
   if (params.save_interval > 0) {
     std::chrono::duration duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start_point);
     printf("[Iters: %d/%d] [Time: %.4fs/%.2f] [Wall Time: %.4fs]\n", iters, params.iters, world->time, params.target_time, (double) duration.count() / 1000);
   }
 
+  if (world->perf) world->perf->print_summary();
+
   // Close output file
   if (params.data_file_out) world->write_footers(file);
   file.close();
+  analysis_file.close();
+  if (surface) surface->write_footer(surface_file);
+  surface_file.close();
+  delete analysis;
+  delete surface;
+  delete live;
   return 0;
 }
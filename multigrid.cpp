@@ -0,0 +1,293 @@
+#include "multigrid.h"
+#include "kernel.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+
+const int COARSEST_NODES = 64;  // Levels are added until at most this many nodes
+const int MAX_LEVELS = 12;
+const int SMOOTHING_SWEEPS = 2; // Before and after the coarse correction
+const int COARSEST_SWEEPS = 30;
+const double JACOBI_WEIGHT = 2.0 / 3.0;
+
+void add_entry(std::vector<std::pair<int, double>> &row, int col, double value) {
+  for (auto &entry: row) {
+    if (entry.first == col) {
+      entry.second += value;
+      return;
+    }
+  }
+  row.push_back({col, value});
+}
+
+void PressureMultigrid::setup(World *w, double dt2, double *aii) {
+  levels.clear();
+  build_first_level(w, dt2, aii);
+  while (levels.size() > 0 && levels.size() < MAX_LEVELS && levels.back().cells.size() > COARSEST_NODES) {
+    build_next_level();
+  }
+}
+
+int PressureMultigrid::n_levels() {
+  return levels.size();
+}
+
+void add_entry(std::vector<std::pair<int, vec>> &row, int col, vec value) {
+  for (auto &entry: row) {
+    if (entry.first == col) {
+      entry.second += value;
+      return;
+    }
+  }
+  row.push_back({col, value});
+}
+
+// The rows of A summed over the active particles of each cell. The pressure
+// acceleration of an active particle, with boundary particles mirroring pᵢ,
+//   accᵢ = pᵢ cᵢ - ∑ₖ mₖ/ρₖ² pₖ ∇W_ik,  cᵢ = -∑ₖ mₖ (1/ρᵢ² + [k boundary]/ρₖ²) ∇W_ik
+// is first summed per node of the pₖ, then with gᵢ = ∑ⱼ mⱼ ∇W_ij
+//   (Ap)ᵢ = dt² ∑ⱼ mⱼ (accᵢ - accⱼ) · ∇W_ij = dt² gᵢ · accᵢ - dt² ∑ⱼ mⱼ ∇W_ij · accⱼ
+// where the pₖ and accⱼ terms run over active particles only.
+void PressureMultigrid::build_first_level(World *w, double dt2, double *aii) {
+  size_t n = w->particles.size();
+  aggregate.assign(n, -1);
+  node_start.assign(1, 0);
+  node_particles.clear();
+  levels.emplace_back();
+  Level &level = levels.back();
+
+  for (GridBox *box: w->grid->get_hash_map()->used_boxes()) {
+    for (Particle *p: box->particles) {
+      if (!aii[p->idx]) continue;
+      aggregate[p->idx] = level.cells.size();
+      node_particles.push_back(p->idx);
+    }
+    if ((int) node_particles.size() == node_start.back()) continue;
+    level.cells.push_back(box->grid_id);
+    node_start.push_back(node_particles.size());
+  }
+  int n_nodes = level.cells.size();
+  if (n_nodes == 0) {
+    levels.clear();
+    return;
+  }
+
+  acc_rows.resize(std::max(acc_rows.size(), n));
+  #pragma omp parallel for
+  for (Particle &p: w->particles) {
+    if (!aii[p.idx]) continue;
+    auto &row = acc_rows[p.idx];
+    row.clear();
+    vec c = {0};
+    for (Particle *pk: w->grid->get_neighbours(&p)) {
+      vec grad = gradW(p.pos, pk->pos);
+      double factor = 1 / (p.rho * p.rho) + (pk->boundary_particle ? 1 / (pk->rho * pk->rho) : 0.0);
+      c -= pk->mass * factor * grad;
+      if (aii[pk->idx]) add_entry(row, aggregate[pk->idx], -pk->mass / (pk->rho * pk->rho) * grad);
+    }
+    add_entry(row, aggregate[p.idx], c);
+  }
+
+  rows.resize(std::max(rows.size(), (size_t) n_nodes));
+  #pragma omp parallel for schedule(dynamic, 64)
+  for (int node = 0; node < n_nodes; node++) {
+    auto &row = rows[node];
+    row.clear();
+    for (int k = node_start[node]; k < node_start[node + 1]; k++) {
+      Particle *pi = &w->particles[node_particles[k]];
+      vec g = {0};
+      for (Particle *pj: w->grid->get_neighbours(pi)) {
+        vec d = pj->mass * gradW(pi->pos, pj->pos);
+        g += d;
+        if (!aii[pj->idx]) continue;
+        for (auto &entry: acc_rows[pj->idx]) {
+          add_entry(row, entry.first, -dt2 * dot(d, entry.second));
+        }
+      }
+      for (auto &entry: acc_rows[pi->idx]) {
+        add_entry(row, entry.first, dt2 * dot(g, entry.second));
+      }
+    }
+  }
+  store_rows(level);
+}
+
+// Key of the 2x2 (2x2x2) block of a cell, coordinates within ±2²⁰
+uint64_t block_key(GridId &cell) {
+  uint64_t key = (uint64_t) ((cell.x >> 1) & 0x1fffff) << 42 | (uint64_t) ((cell.y >> 1) & 0x1fffff) << 21;
+#if SPH_DIM == 3
+  key |= (uint64_t) ((cell.z >> 1) & 0x1fffff);
+#endif
+  return key;
+}
+
+void PressureMultigrid::build_next_level() {
+  levels.emplace_back();
+  Level &fine = levels[levels.size() - 2];
+  Level &coarse = levels.back();
+  int n_fine = fine.cells.size();
+
+  std::unordered_map<uint64_t, int> nodes;
+  fine.parent.resize(n_fine);
+  for (int i = 0; i < n_fine; i++) {
+    auto found = nodes.emplace(block_key(fine.cells[i]), coarse.cells.size());
+    if (found.second) {
+      GridId cell = fine.cells[i];
+      cell.x >>= 1;
+      cell.y >>= 1;
+#if SPH_DIM == 3
+      cell.z >>= 1;
+#endif
+      coarse.cells.push_back(cell);
+    }
+    fine.parent[i] = found.first->second;
+  }
+
+  int n_coarse = coarse.cells.size();
+  coarse.child_start.assign(n_coarse + 1, 0);
+  for (int i = 0; i < n_fine; i++) coarse.child_start[fine.parent[i] + 1]++;
+  for (int node = 0; node < n_coarse; node++) coarse.child_start[node + 1] += coarse.child_start[node];
+  coarse.children.resize(n_fine);
+  std::vector<int> next(coarse.child_start.begin(), coarse.child_start.end() - 1);
+  for (int i = 0; i < n_fine; i++) coarse.children[next[fine.parent[i]]++] = i;
+
+  #pragma omp parallel for schedule(dynamic, 64)
+  for (int node = 0; node < n_coarse; node++) {
+    auto &row = rows[node];
+    row.clear();
+    for (int c = coarse.child_start[node]; c < coarse.child_start[node + 1]; c++) {
+      int i = coarse.children[c];
+      for (int k = fine.row_start[i]; k < fine.row_start[i + 1]; k++) {
+        add_entry(row, fine.parent[fine.cols[k]], fine.values[k]);
+      }
+    }
+  }
+  store_rows(coarse);
+}
+
+void PressureMultigrid::store_rows(Level &level) {
+  int n = level.cells.size();
+  level.row_start.resize(n + 1);
+  level.row_start[0] = 0;
+  for (int i = 0; i < n; i++) {
+    level.row_start[i + 1] = level.row_start[i] + rows[i].size();
+  }
+  level.cols.resize(level.row_start[n]);
+  level.values.resize(level.row_start[n]);
+  level.diagonal.assign(n, 0.0);
+  #pragma omp parallel for
+  for (int i = 0; i < n; i++) {
+    int k = level.row_start[i];
+    for (auto &entry: rows[i]) {
+      level.cols[k] = entry.first;
+      level.values[k] = entry.second;
+      if (entry.first == i) level.diagonal[i] = entry.second;
+      k++;
+    }
+  }
+  level.b.resize(n);
+  level.x.resize(n);
+  level.r.resize(n);
+  level.correction.resize(n);
+  level.q.resize(n);
+}
+
+// r = b - A x
+void PressureMultigrid::residual(Level &level) {
+  int n = level.cells.size();
+  #pragma omp parallel for
+  for (int i = 0; i < n; i++) {
+    double Ax = 0.0;
+    for (int k = level.row_start[i]; k < level.row_start[i + 1]; k++) {
+      Ax += level.values[k] * level.x[level.cols[k]];
+    }
+    level.r[i] = level.b[i] - Ax;
+  }
+}
+
+// Weighted Jacobi
+void PressureMultigrid::smooth(Level &level, int sweeps) {
+  int n = level.cells.size();
+  for (int sweep = 0; sweep < sweeps; sweep++) {
+    residual(level);
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+      if (level.diagonal[i]) level.x[i] += JACOBI_WEIGHT * level.r[i] / level.diagonal[i];
+    }
+  }
+}
+
+// Solves A x = b of level l approximately, starting at x = 0
+void PressureMultigrid::cycle(size_t l) {
+  Level &level = levels[l];
+  int n = level.cells.size();
+  std::fill(level.x.begin(), level.x.end(), 0.0);
+  if (l + 1 == levels.size()) {
+    smooth(level, COARSEST_SWEEPS);
+    return;
+  }
+
+  smooth(level, SMOOTHING_SWEEPS);
+  residual(level);
+  Level &coarse = levels[l + 1];
+  int n_coarse = coarse.cells.size();
+  #pragma omp parallel for
+  for (int node = 0; node < n_coarse; node++) {
+    double sum = 0.0;
+    for (int c = coarse.child_start[node]; c < coarse.child_start[node + 1]; c++) {
+      sum += level.r[coarse.children[c]];
+    }
+    coarse.b[node] = sum;
+  }
+  cycle(l + 1);
+
+  // The piecewise constant correction is scaled to minimize the residual,
+  // as unsmoothed aggregation undershoots
+  #pragma omp parallel for
+  for (int i = 0; i < n; i++) {
+    level.correction[i] = coarse.x[level.parent[i]];
+  }
+  double rq = 0.0, qq = 0.0;
+  #pragma omp parallel for reduction(+: rq, qq)
+  for (int i = 0; i < n; i++) {
+    double q = 0.0;
+    for (int k = level.row_start[i]; k < level.row_start[i + 1]; k++) {
+      q += level.values[k] * level.correction[level.cols[k]];
+    }
+    rq += level.r[i] * q;
+    qq += q * q;
+  }
+  double alpha = qq > 0 ? rq / qq : 0.0;
+  #pragma omp parallel for
+  for (int i = 0; i < n; i++) {
+    level.x[i] += alpha * level.correction[i];
+  }
+  smooth(level, SMOOTHING_SWEEPS);
+}
+
+void PressureMultigrid::solve(World *w, double *r, double *e) {
+  if (levels.empty()) {
+    #pragma omp parallel for
+    for (size_t i = 0; i < w->particles.size(); i++) e[i] = 0.0;
+    return;
+  }
+
+  Level &level = levels[0];
+  int n_nodes = level.cells.size();
+  #pragma omp parallel for
+  for (int node = 0; node < n_nodes; node++) {
+    double sum = 0.0;
+    for (int k = node_start[node]; k < node_start[node + 1]; k++) {
+      sum += r[node_particles[k]];
+    }
+    level.b[node] = sum;
+  }
+
+  cycle(0);
+
+  #pragma omp parallel for
+  for (size_t i = 0; i < w->particles.size(); i++) {
+    e[i] = aggregate[i] < 0 ? 0.0 : level.x[aggregate[i]];
+  }
+}
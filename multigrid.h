@@ -0,0 +1,62 @@
+#ifndef __SPH_MULTIGRID
+#define __SPH_MULTIGRID
+
+#include "types.h"
+#include <vector>
+
+// Coarse levels of the IISPH pressure equation A p = dt² ∇²p = s, for a
+// coarse grid correction of the relaxed Jacobi iteration, which alone only
+// moves pressure error one neighbour ring per iteration.
+//
+// The first level has a node per Grid cell (its active particles), each
+// further level a node per 2x2 (2x2x2) block of the last one's cells. The
+// operators are Galerkin products Aₗ₊₁ = Pᵀ Aₗ P with piecewise constant
+// prolongation P, starting from the particles' rows of A.
+//
+// A cycle costs four applications of the particles' A plus the coarse
+// levels, against one per Jacobi iteration, so it pays off where Jacobi is
+// slowest: deep, settled fluid.
+class PressureMultigrid {
+  typedef struct {
+    std::vector<GridId> cells;
+    // Operator (CSR) and its diagonal
+    std::vector<int> row_start;
+    std::vector<int> cols;
+    std::vector<double> values;
+    std::vector<double> diagonal;
+    std::vector<int> parent; // Node of the next level
+    // Nodes of the previous level of each node (CSR), in ascending order
+    std::vector<int> child_start;
+    std::vector<int> children;
+    // V-cycle vectors
+    std::vector<double> b, x, r, correction, q;
+  } Level;
+
+  std::vector<Level> levels;
+  // Active particles of the first level's nodes (CSR), and the node of
+  // each particle (-1 if inactive)
+  std::vector<int> node_start;
+  std::vector<int> node_particles;
+  std::vector<int> aggregate;
+  // Rows being summed, (column, value) pairs, and the pressure acceleration
+  // of each active particle as (node, coefficient) pairs
+  std::vector<std::vector<std::pair<int, double>>> rows;
+  std::vector<std::vector<std::pair<int, vec>>> acc_rows;
+
+  void build_first_level(World *w, double dt2, double *aii);
+  void build_next_level();
+  void store_rows(Level &level);
+  void residual(Level &level);
+  void smooth(Level &level, int sweeps);
+  void cycle(size_t l);
+
+public:
+  // Rebuilds the levels for the current positions. aii marks the active
+  // particles (aᵢᵢ != 0).
+  void setup(World *w, double dt2, double *aii);
+  int n_levels();
+  // e = P A₁⁻¹ Pᵀ r approximately (one V-cycle over the coarse levels)
+  void solve(World *w, double *r, double *e);
+};
+
+#endif
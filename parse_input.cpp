@@ -2,60 +2,155 @@
 #include <algorithm>
 #include <cmath>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <fstream>
-#include <memory>
+#include <sstream>
 #include <vector>
 
 using std::istream;
 
-std::vector<Particle> parse_input_file(std::string filename, int scale) {
+// Each character of the scene becomes scale x scale particles, and in 3D is
+// extruded over depth characters along z
+void add_particles(std::vector<Particle> &particles, char ch, bool boundary, double x, double y, int scale, int depth) {
+  int z_count = SPH_DIM == 3 ? scale * depth : 1;
+  for (int ix=0; ix < scale; ix++) {
+    for (int iy=0; iy < scale; iy++) {
+      for (int iz=0; iz < z_count; iz++) {
+        Particle p = {0};
+        p.symbol = ch;
+        p.idx = particles.size();
+        p.pos = {x + SPACING * ix, y + SPACING * iy};
+#if SPH_DIM == 3
+        p.pos.z = SPACING * iz;
+#endif
+        p.vel = {0};
+        p.boundary_particle = boundary;
+        particles.push_back(p);
+      }
+    }
+  }
+}
+
+#if SPH_DIM == 3
+// Front and back walls covering the whole scene
+void add_depth_walls(std::vector<Particle> &particles, char ch, double x_max, double y_min, int scale, int depth) {
+  double z_walls[2] = {-SPACING, SPACING * scale * depth};
+  for (double z: z_walls) {
+    int x_count = std::round(x_max / SPACING) + 1;
+    int y_count = std::round(-y_min / SPACING) + scale;
+    for (int ix = 0; ix < x_count; ix++) {
+      for (int iy = 0; iy < y_count; iy++) {
+        Particle p = {0};
+        p.symbol = ch;
+        p.idx = particles.size();
+        p.pos = {SPACING * ix, y_min + SPACING * iy, z};
+        p.vel = {0};
+        p.boundary_particle = true;
+        particles.push_back(p);
+      }
+    }
+  }
+}
+#endif
+
+// Lines starting with @ add inflow and outflow, in characters of the scene
+// (column, row counted from 0 at the top left):
+//   @emit C COL ROW WIDTH VX VY  Emits particles C with velocity (VX, VY)
+//                                from a face WIDTH characters long, down
+//                                from (COL, ROW) if |VX| >= |VY| else to
+//                                the right
+//   @sink COL ROW WIDTH HEIGHT   Removes the fluid in these characters
+// Returns what is wrong with the directive, or ""
+std::string parse_directive(std::string line, int scale, int depth, std::vector<Emitter> &emitters, std::vector<Sink> &sinks) {
+  std::istringstream words(line);
+  std::string kind;
+  words >> kind;
+  double cell = SPACING * scale;
+  int z_count = SPH_DIM == 3 ? scale * depth : 1;
+
+  if (kind == "emit") {
+    Emitter e = {0};
+    int col, row, width;
+    if (!(words >> e.symbol >> col >> row >> width >> e.vel.x >> e.vel.y) || width <= 0 || norm_square(e.vel) == 0) {
+      return "Invalid emitter: @" + line;
+    }
+    bool vertical = std::abs(e.vel.x) >= std::abs(e.vel.y);
+    for (int k = 0; k < width * scale; k++) {
+      for (int iz = 0; iz < z_count; iz++) {
+        vec pos = {col * cell, -row * cell};
+        if (vertical) pos.y -= (k / scale) * cell - (k % scale) * SPACING;
+        else pos.x += k * SPACING;
+#if SPH_DIM == 3
+        pos.z = SPACING * iz;
+#endif
+        e.face.push_back(pos);
+      }
+    }
+    emitters.push_back(e);
+  } else if (kind == "sink") {
+    Sink s;
+    int col, row, width, height;
+    if (!(words >> col >> row >> width >> height) || width <= 0 || height <= 0) {
+      return "Invalid sink: @" + line;
+    }
+    s.min = {col * cell - SPACING / 2, -(row + height - 1) * cell - SPACING / 2};
+    s.max = {(col + width) * cell - SPACING / 2, -row * cell + cell - SPACING / 2};
+    sinks.push_back(s);
+  } else {
+    return "Unknown scene directive: @" + line;
+  }
+  return "";
+}
+
+std::vector<Particle> parse_input_file(std::string filename, int scale, int depth, bool echo, std::vector<Emitter> &emitters, std::vector<Sink> &sinks, std::string *error) {
+  auto fail = [error](std::string problem) {
+    if (!error) {
+      std::cerr << problem << std::endl;
+      exit(1);
+    }
+    *error = problem;
+    return std::vector<Particle>();
+  };
   std::ifstream file(filename);
   char ch;
   std::vector<Particle> particles;
   std::vector<char> boundary_chars;
   bool firstline = true;
+  bool line_start = true;
   double x = 0, y = 0;
+  double x_max = 0, y_min = 0;
 
-  if (!file) {
-    std::cerr << "Couldn't open file" << std::endl;
-    exit(1);
-  }
+  if (!file) return fail("Couldn't open file " + filename);
 
   #define IS_BOUNDARY_CHAR std::find(boundary_chars.begin(), boundary_chars.end(), ch) != boundary_chars.end()
 
-  while (!file.eof()) {
-    file.read(&ch, 1);
-    printf("%c", ch);
+  while (file.read(&ch, 1)) {
+    if (line_start && ch == '@') {
+      std::string line;
+      std::getline(file, line);
+      if (echo) printf("@%s\n", line.c_str());
+      std::string problem = parse_directive(line, scale, depth, emitters, sinks);
+      if (problem != "") return fail(problem);
+      continue;
+    }
+    line_start = ch == '\n';
+
+    if (echo) printf("%c", ch);
     if (ch == ' ' || ch == '\n') {
       // Ignore spaces
     } else if (firstline || IS_BOUNDARY_CHAR) {
-      for (int ix=0; ix<scale; ix++) {
-        for (int iy=0; iy<scale; iy++) {
-          Particle p = {0};
-          p.symbol = ch;
-          p.idx = particles.size();
-          p.pos = {x + SPACING * ix, y + SPACING * iy};
-          p.vel = {0, 0};
-          p.boundary_particle = true;
-          particles.push_back(p);
-          if (firstline && !(IS_BOUNDARY_CHAR)) {
-            boundary_chars.push_back(ch);
-          }
-        }
+      if (firstline && !(IS_BOUNDARY_CHAR)) {
+        boundary_chars.push_back(ch);
       }
+      add_particles(particles, ch, true, x, y, scale, depth);
     } else {
-      for (int ix=0; ix < scale; ix++) {
-        for (int iy=0; iy < scale; iy++) {
-          Particle p = {0};
-          p.symbol = ch;
-          p.idx = particles.size();
-          p.pos = {x + SPACING * ix, y + SPACING * iy};
-          p.vel = {0, 0};
-          p.boundary_particle = false;
-          particles.push_back(p);
-        }
-      }
+      add_particles(particles, ch, false, x, y, scale, depth);
+    }
+
+    if (ch != ' ' && ch != '\n') {
+      x_max = std::max(x_max, x + SPACING * (scale - 1));
+      y_min = std::min(y_min, y);
     }
 
     if (ch == '\n') {
@@ -67,44 +162,85 @@ std::vector<Particle> parse_input_file(std::string filename, int scale) {
     }
   }
 
+#if SPH_DIM == 3
+  if (boundary_chars.size() > 0) {
+    add_depth_walls(particles, boundary_chars[0], x_max, y_min, scale, depth);
+  }
+#endif
+
   file.close();
   return particles;
 }
 
-void render_to_terminal(World *w) {
-  vec2 bounds_max = w->particles[0].pos;
-  vec2 bounds_min = bounds_max;
-  for (Particle& p: w->particles) {
-    bounds_max.x = std::max(bounds_max.x, p.pos.x);
-    bounds_max.y = std::max(bounds_max.y, p.pos.y);
-    bounds_min.x = std::min(bounds_min.x, p.pos.x);
-    bounds_min.y = std::min(bounds_min.y, p.pos.y);
-  }
-
-  // Initialize render buffer
-  int x_size = std::ceil((bounds_max.x - bounds_min.x) / SPACING) + 1;
-  int y_size = std::ceil((bounds_max.y - bounds_min.y) / SPACING) + 1;
-  int total_size = x_size * y_size;
-  std::unique_ptr<char[]> render_buffer(new char[total_size]);
+TerminalRenderer::TerminalRenderer() {
+  sized = false;
+}
 
-  for (int i=0; i < total_size; i++) {
-    render_buffer[i] = ' ';
+void TerminalRenderer::render(int n, const float *pos, int dim, const char *symbols, const uint8_t *boundary) {
+  if (n == 0) return;
+  // The canvas is sized from the first frame and kept, particles that later
+  // leave it are not drawn
+  if (!sized) {
+    x_min = INFINITY;
+    double x_max = -INFINITY, y_min = INFINITY, y_max = -INFINITY;
+    for (int i = 0; i < n; i++) {
+      x_min = std::min(x_min, (double) pos[i * dim]);
+      x_max = std::max(x_max, (double) pos[i * dim]);
+      y_min = std::min(y_min, (double) pos[i * dim + 1]);
+      y_max = std::max(y_max, (double) pos[i * dim + 1]);
+    }
+    y_top = y_max;
+    x_size = std::round((x_max - x_min) / SPACING) + 1;
+    y_size = std::round((y_max - y_min) / SPACING) + 1;
+    sized = true;
+    fputs("\033[2J", stdout); // Clear the screen
   }
 
-  for (Particle& p: w->particles) {
-    int x = std::ceil((p.pos.x - bounds_min.x) / SPACING);
-    int y = std::ceil((bounds_max.y - p.pos.y) / SPACING);
-    render_buffer[y * x_size + x] = p.symbol;
+  // Cursor to the top-left corner, then the rows
+  const char *home = "\033[H";
+  int row = x_size + 1;
+  canvas.assign(strlen(home) + row * y_size + 1, ' ');
+  memcpy(canvas.data(), home, strlen(home));
+  char *rows = canvas.data() + strlen(home);
+  for (int y = 0; y < y_size; y++) {
+    rows[y * row + x_size] = '\n';
   }
+  canvas.back() = '\n';
 
-  printf("\033[2J"); // Clear the screen
-  printf("\033[H");  // Move the cursor to the top-left corner
-  for (int y = 0; y < y_size; y++) {
-    for (int x = 0; x < x_size; x++) {
-      printf("%c", render_buffer[y * x_size + x]);
+  // Fluid is drawn over the boundary (which in 3D has walls in front of it)
+  for (int fluid = 0; fluid <= 1; fluid++) {
+    for (int i = 0; i < n; i++) {
+      if (boundary[i] == !fluid) continue;
+      int x = std::round((pos[i * dim] - x_min) / SPACING);
+      int y = std::round((y_top - pos[i * dim + 1]) / SPACING);
+      if (x < 0 || x >= x_size || y < 0 || y >= y_size) continue;
+      rows[y * row + x] = symbols[i];
     }
-    printf("\n");
   }
 
-  printf("\n");
+  fwrite(canvas.data(), 1, canvas.size(), stdout);
+  fflush(stdout);
+}
+
+void render_to_terminal(World *w) {
+  static TerminalRenderer renderer;
+  static std::vector<float> pos;
+  static std::vector<char> symbols;
+  static std::vector<uint8_t> boundary;
+
+  int n = w->particles.size();
+  pos.resize(n * SPH_DIM);
+  symbols.resize(n);
+  boundary.resize(n);
+  for (int i = 0; i < n; i++) {
+    Particle &p = w->particles[i];
+    pos[i * SPH_DIM] = p.pos.x;
+    pos[i * SPH_DIM + 1] = p.pos.y;
+#if SPH_DIM == 3
+    pos[i * SPH_DIM + 2] = p.pos.z;
+#endif
+    symbols[i] = p.symbol;
+    boundary[i] = p.boundary_particle;
+  }
+  renderer.render(n, pos.data(), SPH_DIM, symbols.data(), boundary.data());
 }
@@ -0,0 +1,176 @@
+#include "perf.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <omp.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+const char *PERF_EVENT_NAMES[PERF_EVENTS] = {"cycles", "instructions", "LLC misses", "branch misses", "stalled cycles"};
+
+#ifdef __linux__
+// Events to try for each counter, in order of preference
+typedef struct {
+  uint32_t type;
+  uint64_t config;
+} EventConfig;
+
+const EventConfig LLC_READ_MISSES = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+const std::vector<EventConfig> EVENT_CONFIGS[PERF_EVENTS] = {
+  {{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES}},
+  {{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS}},
+  {LLC_READ_MISSES, {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}},
+  {{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}},
+  {{PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND}, {PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND}}};
+
+// Counter of the calling thread, -1 and errno set on failure
+int open_counter(int event) {
+  for (const EventConfig &config: EVENT_CONFIGS[event]) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = config.type;
+    attr.config = config.config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // Scaled by enabled / running time when the counters are multiplexed
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd >= 0) return fd;
+  }
+  return -1;
+}
+#endif
+
+PerfCounters::PerfCounters() {
+  int n_threads = omp_get_max_threads();
+  fds.assign(n_threads, std::vector<int>(PERF_EVENTS, -1));
+  for (int e = 0; e < PERF_EVENTS; e++) available[e] = true;
+
+#ifdef __linux__
+  std::vector<int> errors(PERF_EVENTS, 0);
+  #pragma omp parallel num_threads(n_threads)
+  {
+    int t = omp_get_thread_num();
+    for (int e = 0; e < PERF_EVENTS; e++) {
+      fds[t][e] = open_counter(e);
+      if (fds[t][e] < 0) {
+        #pragma omp critical
+        errors[e] = errno;
+      }
+    }
+  }
+  // Counted on all threads or not at all
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    if (errors[e] == 0) continue;
+    available[e] = false;
+    std::cerr << "Hardware counter " << PERF_EVENT_NAMES[e] << " unavailable: " << strerror(errors[e]) << std::endl;
+    for (int t = 0; t < n_threads; t++) {
+      if (fds[t][e] >= 0) close(fds[t][e]);
+      fds[t][e] = -1;
+    }
+  }
+#else
+  for (int e = 0; e < PERF_EVENTS; e++) available[e] = false;
+  std::cerr << "Hardware counters need Linux perf_event_open" << std::endl;
+#endif
+}
+
+PerfCounters::~PerfCounters() {
+#ifdef __linux__
+  for (auto &thread_fds: fds) {
+    for (int fd: thread_fds) {
+      if (fd >= 0) close(fd);
+    }
+  }
+#endif
+}
+
+bool PerfCounters::enabled() {
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    if (available[e]) return true;
+  }
+  return false;
+}
+
+PerfSample PerfCounters::read() {
+  PerfSample sample = {0};
+#ifdef __linux__
+  for (auto &thread_fds: fds) {
+    for (int e = 0; e < PERF_EVENTS; e++) {
+      if (thread_fds[e] < 0) continue;
+      uint64_t data[3]; // Value, time enabled, time running
+      if (::read(thread_fds[e], data, sizeof(data)) != sizeof(data) || data[2] == 0) continue;
+      sample.values[e] += (double) data[0] * data[1] / data[2];
+    }
+  }
+#endif
+  return sample;
+}
+
+void PerfCounters::start(const std::string &name) {
+  started[name] = read();
+}
+
+void PerfCounters::end(const std::string &name) {
+  PerfSample now = read();
+  PerfSample &start = started[name];
+  PerfSample &sum = total[name];
+  PerfSample delta;
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    delta.values[e] = now.values[e] - start.values[e];
+    sum.values[e] += delta.values[e];
+  }
+  current[name] = delta;
+  counts[name]++;
+}
+
+// 12345678 as 12.3M
+std::string short_count(double value) {
+  char text[16];
+  if (value >= 1e9) snprintf(text, sizeof(text), "%.1fG", value / 1e9);
+  else if (value >= 1e6) snprintf(text, sizeof(text), "%.1fM", value / 1e6);
+  else if (value >= 1e3) snprintf(text, sizeof(text), "%.1fk", value / 1e3);
+  else snprintf(text, sizeof(text), "%.0f", value);
+  return text;
+}
+
+std::string format_sample(bool *available, const PerfSample &sample, double scale) {
+  std::string text;
+  const double *v = sample.values;
+  if (available[PERF_CYCLES] && available[PERF_INSTRUCTIONS] && v[PERF_CYCLES] > 0) {
+    char ipc[32];
+    snprintf(ipc, sizeof(ipc), " IPC %.2f", v[PERF_INSTRUCTIONS] / v[PERF_CYCLES]);
+    text += ipc;
+  }
+  if (available[PERF_LLC_MISSES]) text += " LLC " + short_count(v[PERF_LLC_MISSES] * scale);
+  if (available[PERF_BRANCH_MISSES]) text += " BrMiss " + short_count(v[PERF_BRANCH_MISSES] * scale);
+  if (available[PERF_CYCLES] && available[PERF_STALLED_CYCLES] && v[PERF_CYCLES] > 0) {
+    char stalled[32];
+    snprintf(stalled, sizeof(stalled), " Stalled %.0f%%", 100 * v[PERF_STALLED_CYCLES] / v[PERF_CYCLES]);
+    text += stalled;
+  }
+  return text;
+}
+
+std::string PerfCounters::format(const std::string &name) {
+  auto found = current.find(name);
+  if (found == current.end()) return "";
+  return format_sample(available, found->second, 1.0);
+}
+
+void PerfCounters::print_summary() {
+  printf("[Counters per measurement, summed over %zu threads]\n", fds.size());
+  for (auto &phase: total) {
+    int count = counts[phase.first];
+    const double *v = phase.second.values;
+    printf("  %-18s %6d x  cycles %8s  instructions %8s %s\n", phase.first.c_str(), count,
+           available[PERF_CYCLES] ? short_count(v[PERF_CYCLES] / count).c_str() : "-",
+           available[PERF_INSTRUCTIONS] ? short_count(v[PERF_INSTRUCTIONS] / count).c_str() : "-",
+           format_sample(available, phase.second, 1.0 / count).c_str());
+  }
+}
@@ -0,0 +1,45 @@
+#ifndef __SPH_PERF
+#define __SPH_PERF
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Hardware counters of the named phases of World's timers, counted on
+// every OpenMP thread with Linux perf_event_open and summed. Counters that
+// can't be opened (not Linux, perf_event_paranoid, an event the cpu lacks)
+// are left out, and with none the phases only have their timings.
+const int PERF_EVENTS = 5;
+enum PerfEvent { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_LLC_MISSES, PERF_BRANCH_MISSES, PERF_STALLED_CYCLES };
+
+typedef struct {
+  double values[PERF_EVENTS];
+} PerfSample;
+
+class PerfCounters {
+  // Per thread file descriptors, -1 if not open
+  std::vector<std::vector<int>> fds;
+  bool available[PERF_EVENTS];
+  std::unordered_map<std::string, PerfSample> started;
+  std::unordered_map<std::string, PerfSample> current; // Last measurement
+  std::unordered_map<std::string, PerfSample> total;
+  std::unordered_map<std::string, int> counts;
+  PerfSample read();
+
+public:
+  // Opens the counters on each OpenMP thread, reporting why they aren't
+  // available on stderr
+  PerfCounters();
+  ~PerfCounters();
+  bool enabled();
+  void start(const std::string &name);
+  void end(const std::string &name);
+  // IPC, LLC misses, branch misses and stalled cycles of the last
+  // measurement of the phase ("" without one)
+  std::string format(const std::string &name);
+  // Per phase means over the run
+  void print_summary();
+};
+
+#endif
@@ -1,26 +1,214 @@
 #include "types.h"
 #include "kernel.h"
+#include "physics.h"
+#include "tiles.h"
 #include <cmath>
 #include <cassert>
 
 double compute_density(World *w, Particle *p) {
+  const double *ratio = w->density_ratios(*p);
   double rho = p->mass * W(0);
   for (Particle *np: w->grid->get_neighbours(p)) {
-    rho += np->mass * W(distance(p->pos, np->pos));
+    rho += np->mass * ratio[np->phase] * W(distance(p->pos, np->pos));
   }
 
   assert(rho >= 0);
   return rho;
 }
 
+void add_nonpressure_terms(vec x_ij, vec v_ij, double rho_i, double mass_j, double rho_j, bool boundary_j,
+                           double W_ij, vec grad, NonPressureSums &sums) {
+  double r2 = norm_square(x_ij);
+
+  // Laplacian viscosity (Monaghan 2005), boundary particles give no-slip
+  //   aᵢ = 2(d+2) ν ∑ⱼ mⱼ/ρⱼ (v_ij · x_ij) / (|x_ij|² + 0.01h²) ∇W_ij
+  double eta2 = 0.01 * SUPPORT_RADIUS * SUPPORT_RADIUS;
+  sums.viscous += (mass_j / rho_j * dot(v_ij, x_ij) / (r2 + eta2)) * grad;
+  if (boundary_j) return;
+
+  // XSPH: Δvᵢ = ε ∑ⱼ 2mⱼ/(ρᵢ + ρⱼ) (vⱼ - vᵢ) W_ij
+  sums.xsph += (-2 * mass_j / (rho_i + rho_j) * W_ij) * v_ij;
+
+  // Cohesion (Akinci 2013): aᵢ = -γ ∑ⱼ mⱼ C(|x_ij|) x_ij / |x_ij|
+  double r = sqrt(r2);
+  if (r > 1e-8) sums.cohesion += (-mass_j * cohesion_kernel(r) / r) * x_ij;
+}
+
+void add_nonpressure_terms(Particle *pi, Particle *pj, double W_ij, vec grad, NonPressureSums &sums) {
+  add_nonpressure_terms(pi->pos - pj->pos, pi->vel - pj->vel, pi->rho, pj->mass, pj->rho, pj->boundary_particle,
+                        W_ij, grad, sums);
+}
+
+void store_nonpressure_terms(World *w, Particle *pi, NonPressureSums &sums) {
+  const int d = SPH_DIM;
+  double viscosity = w->phases[pi->phase].viscosity;
+  w->viscous_acc[pi->idx] = 2 * (d + 2) * viscosity * sums.viscous + w->surface_tension * sums.cohesion;
+  w->xsph_dv[pi->idx] = w->xsph * sums.xsph;
+}
+
+// Half neighbour list version of compute_density_and_forces(). W and ∇W of
+// each pair are evaluated once, ∇W_ji = -∇W_ij.
+void compute_density_and_forces_symmetric(World *w) {
+  size_t n = w->particles.size();
+  bool forces = w->nonpressure_forces();
+  PairSums<double> rho_sums(w->scratch, n);
+  PairSums<NonPressureSums> force_sums(w->scratch, forces ? n : 0);
+
+  #pragma omp parallel
+  {
+    PairSums<double>::Local rho = rho_sums.local();
+    PairSums<NonPressureSums>::Local sums = force_sums.local();
+    for (size_t i = rho.begin; i < rho.end; i++) {
+      Particle *pi = &w->particles[i];
+      rho.add(i, pi->mass * W(0));
+      for (Particle *pj: w->grid->get_half_neighbours(pi)) {
+        double r = distance(pi->pos, pj->pos);
+        if (r >= SUPPORT_RADIUS) continue;
+
+        double W_ij = W(r);
+        rho.add(i, pj->mass * w->density_ratios(*pi)[pj->phase] * W_ij);
+        rho.add(pj->idx, pi->mass * w->density_ratios(*pj)[pi->phase] * W_ij);
+        if (!forces) continue;
+
+        vec grad = gradW(pi->pos, pj->pos);
+        NonPressureSums terms = {};
+        if (!pi->boundary_particle) {
+          add_nonpressure_terms(pi, pj, W_ij, grad, terms);
+          sums.add(i, terms);
+        }
+        if (!pj->boundary_particle) {
+          terms = {};
+          add_nonpressure_terms(pj, pi, W_ij, -grad, terms);
+          sums.add(pj->idx, terms);
+        }
+      }
+    }
+  }
+
+  if (forces) {
+    NonPressureSums *sums = w->scratch.alloc_array<NonPressureSums>(n);
+    force_sums.reduce(sums);
+    w->viscous_acc = w->scratch.alloc_array<vec>(n);
+    w->xsph_dv = w->scratch.alloc_array<vec>(n);
+    #pragma omp parallel for
+    for (Particle &p: w->particles) {
+      store_nonpressure_terms(w, &p, sums[p.idx]);
+    }
+  }
+
+  double *rho = w->scratch.alloc_array<double>(n);
+  rho_sums.reduce(rho);
+  #pragma omp parallel for
+  for (Particle &p: w->particles) {
+    p.rho = rho[p.idx];
+  }
+}
+
+// Cell centric version of compute_density_and_forces()
+void compute_density_and_forces_tiled(World *w) {
+  size_t n = w->particles.size();
+  bool forces = w->nonpressure_forces();
+  double *rho = w->scratch.alloc_array<double>(n);
+  if (forces) {
+    w->viscous_acc = w->scratch.alloc_array<vec>(n);
+    w->xsph_dv = w->scratch.alloc_array<vec>(n);
+  }
+
+  const std::vector<GridBox*> &boxes = w->grid->get_hash_map()->used_boxes();
+  const double h2 = SUPPORT_RADIUS * SUPPORT_RADIUS;
+  #pragma omp parallel
+  {
+    CellTile tile;
+    #pragma omp for schedule(dynamic, 16)
+    for (GridBox *box: boxes) {
+      tile.gather(w->grid, box);
+      if (forces) tile.gather_velocity();
+      for (int i = 0; i < tile.n_cell; i++) {
+        Particle *pi = tile.particles[i];
+        tile.distances_sq(i);
+        const double *ratio = w->density_ratios(*pi);
+        double rho_i = pi->mass * W(0);
+        bool pair_forces = forces && !pi->boundary_particle;
+        vec x_i = tile.position(i);
+        vec v_i = pair_forces ? tile.velocity(i) : vec{0};
+        NonPressureSums sums = {0};
+        for (int k = 0; k < tile.n; k++) {
+          if (tile.r2[k] >= h2) continue;
+          double W_ij = W(sqrt(tile.r2[k]));
+          rho_i += tile.mass[k] * ratio[tile.phase[k]] * W_ij;
+          if (pair_forces) {
+            vec x_k = tile.position(k);
+            add_nonpressure_terms(x_i - x_k, v_i - tile.velocity(k), tile.rho[i], tile.mass[k], tile.rho[k],
+                                  tile.boundary[k] != 0, W_ij, gradW(x_i, x_k), sums);
+          }
+        }
+        rho[pi->idx] = rho_i;
+        if (forces) store_nonpressure_terms(w, pi, sums);
+      }
+    }
+  }
+
+  #pragma omp parallel for
+  for (Particle &p: w->particles) {
+    p.rho = rho[p.idx];
+  }
+}
+
+// Density, and if enabled the viscous and cohesion forces, in a single pass
+// over the neighbours. The forces use the neighbours' density of the last
+// step, which is why the new densities are kept aside until the pass ends.
+void compute_density_and_forces(World *w) {
+  if (w->tiled) {
+    compute_density_and_forces_tiled(w);
+    return;
+  }
+  if (w->symmetric) {
+    compute_density_and_forces_symmetric(w);
+    return;
+  }
+
+  if (!w->nonpressure_forces()) {
+    #pragma omp parallel for
+    for (Particle &p: w->particles) {
+      p.rho = compute_density(w, &p);
+    }
+    return;
+  }
+
+  double *rho = w->scratch.alloc_array<double>(w->particles.size());
+  w->viscous_acc = w->scratch.alloc_array<vec>(w->particles.size());
+  w->xsph_dv = w->scratch.alloc_array<vec>(w->particles.size());
+
+  #pragma omp parallel for
+  for (Particle &p: w->particles) {
+    const double *ratio = w->density_ratios(p);
+    double rho_i = p.mass * W(0);
+    NonPressureSums sums = {0};
+    for (Particle *pj: w->grid->get_neighbours(&p)) {
+      double W_ij = W(distance(p.pos, pj->pos));
+      rho_i += pj->mass * ratio[pj->phase] * W_ij;
+      if (!p.boundary_particle) add_nonpressure_terms(&p, pj, W_ij, gradW(p.pos, pj->pos), sums);
+    }
+    rho[p.idx] = rho_i;
+    store_nonpressure_terms(w, &p, sums);
+  }
+
+  #pragma omp parallel for
+  for (Particle &p: w->particles) {
+    p.rho = rho[p.idx];
+  }
+}
+
 double density_derivative(World *w, Particle *p) {
   // D rho / Dt = - rho Grad(V)
   //            = - (Grad(rho V) - V Grad(rho))
   //            = - (\sum m_j (v_j - v_i) Grad(W_ij))
+  // with the masses scaled as in the density
 
+  const double *ratio = w->density_ratios(*p);
   double sum = 0.0;
   for (Particle *np : w->grid->get_neighbours(p)) {
-    sum += -np->mass * dot(np->vel - p->vel, gradW(p->pos, np->pos));
+    sum += -np->mass * ratio[np->phase] * dot(np->vel - p->vel, gradW(p->pos, np->pos));
   }
   return  sum;
 }
@@ -29,18 +217,19 @@ double velocity_divergence(World *w, Particle *p) {
   // ∇v = 1/ρ [ ∇(ρv) - v∇ρ ]
   //    = 1/ρᵢ ∑ⱼ mⱼ (vⱼ - vᵢ) ∇W_{ij}
 
+  const double *ratio = w->density_ratios(*p);
   double sum = 0.0;
   for (Particle *np : w->grid->get_neighbours(p)) {
-    sum += np->mass * dot(np->vel - p->vel, gradW(p->pos, np->pos));
+    sum += np->mass * ratio[np->phase] * dot(np->vel - p->vel, gradW(p->pos, np->pos));
   }
   return sum / p->rho;
 }
 
-vec2 pressure_acceleration(World *w, Particle *pi, double pressure[]) {
+vec pressure_acceleration(World *w, Particle *pi, double pressure[]) {
   // ap = Dv/Dt
   //    = - ∇p / ρ
   //    = - ∑ⱼ mⱼ (pᵢ/ρᵢ² + pⱼ/ρⱼ²) ∇W_{ij}
-  vec2 sum = {0};
+  vec sum = {0};
   for (Particle *pj: w->grid->get_neighbours(pi)) {
     if (pj->boundary_particle) {
       // Pressure mirroring by boundary particle
@@ -51,3 +240,60 @@ vec2 pressure_acceleration(World *w, Particle *pi, double pressure[]) {
   }
   return sum;
 }
+
+void pressure_accelerations_symmetric(World *w, double pressure[], vec *acc, PairSums<vec> &sums) {
+  sums.clear();
+  #pragma omp parallel
+  {
+    PairSums<vec>::Local acc_t = sums.local();
+    for (size_t i = acc_t.begin; i < acc_t.end; i++) {
+      Particle *pi = &w->particles[i];
+      for (Particle *pj: w->grid->get_half_neighbours(pi)) {
+        if (pi->boundary_particle && pj->boundary_particle) continue;
+        if (distance(pi->pos, pj->pos) >= SUPPORT_RADIUS) continue;
+
+        vec grad = gradW(pi->pos, pj->pos);
+        double rho_i2 = pi->rho * pi->rho;
+        double rho_j2 = pj->rho * pj->rho;
+        // Boundary particles mirror the pressure of the fluid particle
+        if (!pi->boundary_particle) {
+          double p_j = pj->boundary_particle ? pressure[pi->idx] : pressure[pj->idx];
+          acc_t.add(i, -pj->mass * (pressure[pi->idx] / rho_i2 + p_j / rho_j2) * grad);
+        }
+        if (!pj->boundary_particle) {
+          double p_i = pi->boundary_particle ? pressure[pj->idx] : pressure[pi->idx];
+          acc_t.add(pj->idx, pi->mass * (pressure[pj->idx] / rho_j2 + p_i / rho_i2) * grad);
+        }
+      }
+    }
+  }
+  sums.reduce(acc);
+}
+
+void pressure_accelerations_tiled(World *w, double pressure[], vec *acc, double *aii) {
+  const std::vector<GridBox*> &boxes = w->grid->get_hash_map()->used_boxes();
+  const double h2 = SUPPORT_RADIUS * SUPPORT_RADIUS;
+  #pragma omp parallel
+  {
+    CellTile tile;
+    #pragma omp for schedule(dynamic, 16)
+    for (GridBox *box: boxes) {
+      tile.gather(w->grid, box);
+      tile.gather_scalar(pressure);
+      for (int i = 0; i < tile.n_cell; i++) {
+        Particle *pi = tile.particles[i];
+        if (aii ? !aii[pi->idx] : pi->boundary_particle) continue;
+        tile.distances_sq(i);
+        double p_i = tile.scalar[i] / (tile.rho[i] * tile.rho[i]);
+        vec sum = {0};
+        for (int k = 0; k < tile.n; k++) {
+          if (tile.r2[k] >= h2) continue;
+          // Boundary particles mirror the pressure of the fluid particle
+          double p_k = tile.boundary[k] ? tile.scalar[i] : tile.scalar[k];
+          sum -= tile.mass[k] * (p_i + p_k / (tile.rho[k] * tile.rho[k])) * gradW(pi->pos, tile.position(k));
+        }
+        acc[pi->idx] = sum;
+      }
+    }
+  }
+}
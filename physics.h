@@ -2,8 +2,94 @@
 #define __SPH_PHYSICS
 
 #include "types.h"
+#include <omp.h>
+#include <utility>
+#include <vector>
+
+// Per particle sums over Grid::get_half_neighbours() (each pair once), where
+// each pair adds its terms to both particles. In a parallel region every
+// thread of the team takes a contiguous range of the particles from local()
+// and loops over it. Terms of particles in its range are added in place, the
+// others (pairs across the range borders, few while neighbours have close
+// indices) are listed per thread and added by reduce().
+template <class T>
+class PairSums {
+  T *sums;
+  size_t n;
+  std::vector<std::vector<std::pair<size_t, T>>> spilled;
+
+public:
+  class Local {
+    T *sums;
+    std::vector<std::pair<size_t, T>> *spilled;
+
+  public:
+    size_t begin, end;
+
+    Local(T *sums, std::vector<std::pair<size_t, T>> *spilled, size_t begin, size_t end)
+      : sums(sums), spilled(spilled), begin(begin), end(end) {}
+
+    void add(size_t i, const T &term) {
+      if (i >= begin && i < end) sums[i] += term;
+      else spilled->push_back({i, term});
+    }
+  };
+
+  PairSums(ScratchArena &scratch, size_t n): n(n) {
+    sums = scratch.alloc_array<T>(n);
+    clear();
+  }
+
+  void clear() {
+    #pragma omp parallel for
+    for (size_t i = 0; i < n; i++) sums[i] = T{};
+    for (auto &terms: spilled) terms.clear();
+  }
+
+  // Called by every thread of the team
+  Local local() {
+    #pragma omp single
+    if (spilled.size() < (size_t) omp_get_num_threads()) spilled.resize(omp_get_num_threads());
+    size_t t = omp_get_thread_num(), team = omp_get_num_threads();
+    return Local(sums, &spilled[t], n * t / team, n * (t + 1) / team);
+  }
+
+  void reduce(T *result) {
+    #pragma omp parallel for
+    for (size_t i = 0; i < n; i++) result[i] = sums[i];
+    for (auto &terms: spilled) {
+      for (auto &[i, term]: terms) result[i] += term;
+    }
+  }
+};
+
 double compute_density(World *w, Particle *p);
+void compute_density_and_forces(World *w);
+
+// Neighbour sums of the non pressure forces of one particle
+typedef struct {
+  vec viscous;
+  vec xsph;
+  vec cohesion;
+} NonPressureSums;
+inline NonPressureSums &operator+=(NonPressureSums &a, const NonPressureSums &b) {
+  a.viscous += b.viscous;
+  a.xsph += b.xsph;
+  a.cohesion += b.cohesion;
+  return a;
+}
+// Terms of neighbour j, with x_ij = xᵢ - xⱼ and v_ij = vᵢ - vⱼ
+void add_nonpressure_terms(vec x_ij, vec v_ij, double rho_i, double mass_j, double rho_j, bool boundary_j,
+                           double W_ij, vec grad, NonPressureSums &sums);
+void add_nonpressure_terms(Particle *pi, Particle *pj, double W_ij, vec grad, NonPressureSums &sums);
+void store_nonpressure_terms(World *w, Particle *pi, NonPressureSums &sums);
 double density_derivative(World *w, Particle *p);
 double velocity_divergence(World *w, Particle *p);
-vec2 pressure_acceleration(World *w, Particle *pi, double pressure[]);
+vec pressure_acceleration(World *w, Particle *pi, double pressure[]);
+// pressure_acceleration() of all particles (0 for boundary) over the half
+// neighbour list, using sums as the per thread buffer
+void pressure_accelerations_symmetric(World *w, double pressure[], vec *acc, PairSums<vec> &sums);
+// pressure_acceleration() through CellTile, of the particles with aᵢᵢ != 0
+// (or all fluid particles if aii is nullptr)
+void pressure_accelerations_tiled(World *w, double pressure[], vec *acc, double *aii);
 #endif
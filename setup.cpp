@@ -0,0 +1,80 @@
+#include "types.h"
+#include "kernel.h"
+#include "iisph.h"
+#include "dfsph.h"
+#include "wcsph.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <iostream>
+#include <omp.h>
+
+void setup_initial_mass(World *world) {
+  // Compute initial mass
+  for (Particle &p : world->particles) {
+    double sumW = W(0);
+    for (Particle *np: world->grid->get_neighbours(&p)) {
+      sumW += W(distance(p.pos, np->pos));
+    }
+    p.mass = world->rho_0 / sumW;
+    assert(p.mass >= 0);
+  }
+}
+
+bool known_solver(std::string solver) {
+  for (const char *name: {"iisph", "iisph-mg", "dfsph", "wcsph"}) {
+    if (solver == name) return true;
+  }
+  return false;
+}
+
+Algorithm *make_algorithm(std::string solver, double sound_speed) {
+  if (!known_solver(solver)) {
+    std::cerr << "Unknown solver: " << solver << std::endl;
+    exit(1);
+  }
+  if (solver == "iisph") return new IISPH();
+  if (solver == "iisph-mg") return new IISPH(true);
+  if (solver == "dfsph") return new DFSPH();
+  return new WCSPH(sound_speed);
+}
+
+World *create_world(std::vector<Particle> particles, std::string solver, double sound_speed, double rho_0) {
+  Algorithm *algorithm = make_algorithm(solver, sound_speed);
+  World *w = new World(particles, algorithm);
+  w->rho_0 = rho_0;
+  for (Particle &p: w->particles) {
+    p.rho = rho_0;
+  }
+  w->grid->build();
+  setup_initial_mass(w);
+  w->alg->initialize(w);
+  return w;
+}
+
+World *initialize_world(std::string filename, int parsing_scale, int depth, std::string solver, double sound_speed, double rho_0, bool verbose, std::string *error) {
+  std::vector<Emitter> emitters;
+  std::vector<Sink> sinks;
+  std::vector<Particle> particles = parse_input_file(filename, parsing_scale, depth, verbose, emitters, sinks, error);
+  if (error && *error != "") return nullptr;
+  if (error && particles.empty()) {
+    *error = "No particles in " + filename;
+    return nullptr;
+  }
+  World *w = create_world(particles, solver, sound_speed, rho_0);
+  w->emitters = emitters;
+  w->sinks = sinks;
+  if (verbose) {
+    int fluid_cout = std::count_if(w->particles.begin(), w->particles.end(), [](Particle& p) { return !p.boundary_particle; });
+    printf("World loaded [%zu particles] [%d Fluid] [Solver %s]\n", w->particles.size(), fluid_cout, solver.c_str());
+    if (emitters.size() > 0 || sinks.size() > 0) {
+      printf("Flow [%zu emitters] [%zu sinks]\n", emitters.size(), sinks.size());
+    }
+    #pragma omp parallel
+    {
+      #pragma omp single
+      printf("OMP_NUM_THREADS=%d\n", omp_get_num_threads());
+    }
+  }
+  return w;
+}
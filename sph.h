@@ -0,0 +1,83 @@
+#ifndef __SPH_CAPI
+#define __SPH_CAPI
+
+/* C API of libsph (make lib), for driving the solver in-process.
+ *
+ *   sph_world *w = sph_create_from_scene("scene.txt", 1, "iisph");
+ *   for (int i = 0; i < 100; i++) sph_step(w);
+ *   sph_span pos = sph_positions(w);
+ *   double y0 = pos.data[0 * pos.stride + 1];
+ *   sph_destroy(w);
+ *
+ * Spans point into the world's own arrays, no copies are made. They stay
+ * valid until the next sph_step(), which may move the arrays when emitters
+ * add particles. Values written through them between steps are used by the
+ * next step. Functions returning a world return NULL on failure, with the
+ * reason in sph_last_error(). A world is used by one thread at a time; each
+ * step runs on the OpenMP threads. */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sph_world sph_world;
+
+/* Component c of value i is data[i * stride + c] */
+typedef struct {
+  double *data;
+  size_t count;
+  size_t stride;
+  int components;
+} sph_span;
+
+typedef struct {
+  const char *name;
+  double current_us; /* Of the last measurement */
+  double mean_us;
+  double std_us;
+} sph_timing;
+
+/* Dimension the library was built for (2 or 3) */
+int sph_dimension(void);
+const char *sph_last_error(void);
+
+/* solver: iisph, iisph-mg, dfsph or wcsph */
+sph_world *sph_create_from_scene(const char *filename, int scale, const char *solver);
+/* n particles at positions (sph_dimension() values each), boundary[i] != 0
+ * for boundary particles (NULL: all fluid) */
+sph_world *sph_create(size_t n, const double *positions, const unsigned char *boundary, const char *solver);
+void sph_destroy(sph_world *w);
+
+/* Parameters: max_dt, tolerance, viscosity, xsph, surface_tension,
+ * gravity_x, gravity_y, gravity_z (3D), skin (in h, 0 to 1) and the
+ * switches symmetric, tiled and health (0 or 1). Returns 0, or -1 for an
+ * unknown name, a value out of range or both symmetric and tiled on. */
+int sph_set(sph_world *w, const char *name, double value);
+/* Makes the fluid particles drawn with symbol in the scene (and later
+ * emitted) a phase of their own, with masses rescaled to its rest density.
+ * Returns 0, or -1 for rho_0 <= 0 or past 255 phases. */
+int sph_set_phase(sph_world *w, char symbol, double rho_0, double viscosity);
+
+/* Advances one step, returns its dt */
+double sph_step(sph_world *w);
+double sph_time(sph_world *w);
+size_t sph_count(sph_world *w);
+int sph_is_boundary(sph_world *w, size_t i);
+
+sph_span sph_positions(sph_world *w);
+sph_span sph_velocities(sph_world *w);
+sph_span sph_densities(sph_world *w);
+sph_span sph_masses(sph_world *w);
+sph_span sph_pressures(sph_world *w);
+
+/* Fills up to max timings of the world's phases, returns how many there
+ * are. Names stay valid while the world exists. */
+int sph_timings(sph_world *w, sph_timing *timings, int max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
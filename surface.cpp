@@ -0,0 +1,126 @@
+#include "surface.h"
+#include "kernel.h"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+SurfaceExtractor::SurfaceExtractor(World *w, double resolution, double _iso) {
+#if SPH_DIM == 3
+  std::cerr << "Surface extraction is only available in 2D" << std::endl;
+  exit(1);
+#endif
+  iso = _iso;
+  dx = SPACING / resolution;
+
+  vec min = w->particles[0].pos, max = min;
+  for (Particle &p: w->particles) {
+    min.x = std::min(min.x, p.pos.x);
+    min.y = std::min(min.y, p.pos.y);
+    max.x = std::max(max.x, p.pos.x);
+    max.y = std::max(max.y, p.pos.y);
+  }
+  origin = min;
+  origin.x -= SUPPORT_RADIUS;
+  origin.y -= SUPPORT_RADIUS;
+  nx = std::ceil((max.x - min.x + 2 * SUPPORT_RADIUS) / dx) + 1;
+  ny = std::ceil((max.y - min.y + 2 * SUPPORT_RADIUS) / dx) + 1;
+  field.resize(nx * ny);
+  row_segments.resize(ny - 1);
+}
+
+void SurfaceExtractor::sample_field(World *w) {
+  #pragma omp parallel for
+  for (int k = 0; k < nx * ny; k++) {
+    Particle probe = {0};
+    probe.idx = -1;
+    probe.pos = origin;
+    probe.pos.x += (k % nx) * dx;
+    probe.pos.y += (k / nx) * dx;
+
+    double c = 0.0;
+    for (Particle *pj: w->grid->get_cell_neighbours(&probe)) {
+      if (pj->boundary_particle) continue;
+      c += pj->mass / pj->rho * W(distance(probe.pos, pj->pos));
+    }
+    field[k] = c;
+  }
+}
+
+// Edges of a cell: 0 bottom, 1 right, 2 top, 3 left. Corners: 0 bottom left,
+// 1 bottom right, 2 top right, 3 top left. Segments (pairs of edges) of each
+// corner inside/outside case, -1 terminated. Saddles (5 and 10) are resolved
+// with the cell center.
+const int SEGMENT_EDGES[16][5] = {
+  {-1}, {3, 0, -1}, {0, 1, -1}, {3, 1, -1},
+  {1, 2, -1}, {3, 0, 1, 2, -1}, {0, 2, -1}, {3, 2, -1},
+  {2, 3, -1}, {0, 2, -1}, {0, 1, 2, 3, -1}, {1, 2, -1},
+  {1, 3, -1}, {0, 1, -1}, {3, 0, -1}, {-1}};
+const int EDGE_CORNERS[4][2] = {{0, 1}, {1, 2}, {2, 3}, {3, 0}};
+const int CORNER_OFFSET[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+
+void SurfaceExtractor::march_row(int j) {
+  std::vector<float> &segments = row_segments[j];
+  segments.clear();
+  for (int i = 0; i < nx - 1; i++) {
+    double value[4];
+    int index = 0;
+    for (int c = 0; c < 4; c++) {
+      value[c] = field[(j + CORNER_OFFSET[c][1]) * nx + i + CORNER_OFFSET[c][0]];
+      if (value[c] >= iso) index |= 1 << c;
+    }
+    if (index == 0 || index == 15) continue;
+
+    const int *edges = SEGMENT_EDGES[index];
+    if (index == 5 || index == 10) {
+      // The two inside corners are connected if the center is inside, then
+      // the segments cut off the outside corners instead
+      bool center_inside = (value[0] + value[1] + value[2] + value[3]) / 4 >= iso;
+      if (center_inside) edges = SEGMENT_EDGES[index == 5 ? 10 : 5];
+    }
+
+    for (int e = 0; edges[e] >= 0; e++) {
+      int a = EDGE_CORNERS[edges[e]][0], b = EDGE_CORNERS[edges[e]][1];
+      double t = (iso - value[a]) / (value[b] - value[a]);
+      double x = i + CORNER_OFFSET[a][0] + t * (CORNER_OFFSET[b][0] - CORNER_OFFSET[a][0]);
+      double y = j + CORNER_OFFSET[a][1] + t * (CORNER_OFFSET[b][1] - CORNER_OFFSET[a][1]);
+      segments.push_back(origin.x + x * dx);
+      segments.push_back(origin.y + y * dx);
+    }
+  }
+}
+
+void SurfaceExtractor::write_header(std::ostream &out) {
+  uint8_t flags = (std::endian::native == std::endian::little) ? SIM_LITTLE_ENDIAN : 0;
+  float bounds[4] = {(float) origin.x, (float) origin.y, (float) (origin.x + (nx - 1) * dx), (float) (origin.y + (ny - 1) * dx)};
+  out.write(reinterpret_cast<const char *>(&flags), sizeof(uint8_t));
+  out.write(reinterpret_cast<const char *>(bounds), sizeof(bounds));
+}
+
+void SurfaceExtractor::write_frame(World *w, std::ostream &out) {
+  sample_field(w);
+  #pragma omp parallel for schedule(dynamic, 16)
+  for (int j = 0; j < ny - 1; j++) {
+    march_row(j);
+  }
+
+  std::string buffer;
+  uint8_t next_frame = 1;
+  float time = w->time;
+  uint32_t count = 0;
+  for (auto &segments: row_segments) count += segments.size() / 4;
+  buffer.append(reinterpret_cast<const char *>(&next_frame), sizeof(uint8_t));
+  buffer.append(reinterpret_cast<const char *>(&time), sizeof(float));
+  buffer.append(reinterpret_cast<const char *>(&count), sizeof(uint32_t));
+  for (auto &segments: row_segments) {
+    buffer.append(reinterpret_cast<const char *>(segments.data()), segments.size() * sizeof(float));
+  }
+  out.write(buffer.data(), buffer.size());
+}
+
+void SurfaceExtractor::write_footer(std::ostream &out) {
+  uint8_t next_frame = 0;
+  out.write(reinterpret_cast<const char *>(&next_frame), sizeof(uint8_t));
+}
@@ -0,0 +1,34 @@
+#ifndef __SPH_SURFACE
+#define __SPH_SURFACE
+
+#include "types.h"
+#include <ostream>
+#include <vector>
+
+// Fluid surface as line segments, extracted with marching squares from the
+// SPH color field c(x) = ∑ⱼ mⱼ/ρⱼ W(x - xⱼ) of the fluid sampled on a
+// background grid (c ≈ 1 inside the fluid, 0 outside). 2D only.
+//
+// File: u8 flags (SIM_LITTLE_ENDIAN), f32 x_min, y_min, x_max, y_max of the
+// grid, then per frame u8 1, f32 time, u32 segment count and the segments
+// as f32 x0, y0, x1, y1. A u8 0 ends the file.
+class SurfaceExtractor {
+  vec origin;
+  double dx;
+  int nx, ny; // Grid nodes
+  double iso;
+  std::vector<double> field;
+  std::vector<std::vector<float>> row_segments;
+
+  void sample_field(World *w);
+  void march_row(int j);
+
+public:
+  // The grid covers the initial particles with spacing SPACING / resolution
+  SurfaceExtractor(World *w, double resolution, double iso);
+  void write_header(std::ostream &out);
+  void write_frame(World *w, std::ostream &out);
+  void write_footer(std::ostream &out);
+};
+
+#endif
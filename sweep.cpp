@@ -0,0 +1,176 @@
+#include "sweep.h"
+#include "writer.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <omp.h>
+
+typedef struct {
+  int steps;
+  double wall_time;
+  double density_error;     // Average |ρ - ρ₀| / ρ₀ of the fluid at the end
+  double max_density_error;
+} SweepResult;
+
+std::vector<SweepConfig> parse_sweep_file(std::string filename) {
+  std::ifstream file(filename);
+  if (!file) {
+    std::cerr << "Couldn't open sweep file " << filename << std::endl;
+    exit(1);
+  }
+
+  std::map<std::string, std::vector<std::string>> values = {
+    {"scene", {}}, {"scale", {"1"}}, {"rho_0", {"1000"}},
+    {"max_dt", {"0.005"}}, {"tolerance", {"0.001"}}, {"solver", {"iisph"}}};
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream words(line);
+    std::string key, value;
+    if (!(words >> key) || key[0] == '#') continue;
+    if (values.find(key) == values.end()) {
+      std::cerr << "Unknown sweep parameter: " << key << std::endl;
+      exit(1);
+    }
+    values[key].clear();
+    while (words >> value) values[key].push_back(value);
+  }
+  if (values["scene"].empty()) {
+    std::cerr << "Sweep file has no scene" << std::endl;
+    exit(1);
+  }
+
+  std::vector<SweepConfig> configs;
+  for (auto &scene: values["scene"])
+    for (auto &scale: values["scale"])
+      for (auto &rho_0: values["rho_0"])
+        for (auto &max_dt: values["max_dt"])
+          for (auto &tolerance: values["tolerance"])
+            for (auto &solver: values["solver"])
+              configs.push_back({scene, std::stoi(scale), std::stod(rho_0), std::stod(max_dt), std::stod(tolerance), solver});
+  return configs;
+}
+
+SweepResult run_config(SweepConfig &config, SweepOptions &options, std::string output_filename, std::string analysis_filename, AsyncWriter *writer, std::function<void(World *)> &configure) {
+  auto start = std::chrono::high_resolution_clock::now();
+  World *w = initialize_world(config.scene, config.scale, options.depth, config.solver, options.sound_speed, config.rho_0, false);
+  w->max_dt = config.max_dt;
+  w->tolerance = config.tolerance;
+  configure(w);
+
+  // Frames are serialized here and written by the shared writer
+  std::ostringstream buffer;
+  auto flush = [&]() {
+    writer->write(output_filename, buffer.str());
+    buffer.str("");
+  };
+  bool frames = options.data_file_out;
+  if (frames) {
+    w->write_headers(buffer, options.output_flags);
+    flush();
+  }
+
+  // Statistics are batched before going to the writer
+  std::ostringstream statistics;
+  auto flush_statistics = [&]() {
+    writer->write(analysis_filename, statistics.str());
+    statistics.str("");
+  };
+  if (options.analysis) options.analysis->write_header(statistics);
+
+  SweepResult result = {0};
+  double t = w->time;
+  while ((options.target_time >= 0 || result.steps < options.iters) &&
+         (options.target_time < 0 || w->time < options.target_time)) {
+    result.steps++;
+    w->physics_update();
+    if (options.analysis && result.steps % options.analysis_every == 0) {
+      options.analysis->sample(w, statistics);
+      if (statistics.tellp() > (1 << 16)) flush_statistics();
+    }
+    if (frames && (w->time - t) > options.save_interval) {
+      t = w->time;
+      w->write_frame(buffer);
+      flush();
+    }
+  }
+
+  if (frames) {
+    w->write_footers(buffer);
+    flush();
+    writer->close(output_filename);
+  }
+  if (options.analysis) {
+    flush_statistics();
+    writer->close(analysis_filename);
+  }
+
+  int n_fluid = 0;
+  for (Particle &p: w->particles) {
+    if (p.boundary_particle) continue;
+    double error = std::abs(p.rho - w->rest_density(p)) / w->rest_density(p);
+    result.density_error += error;
+    result.max_density_error = std::max(result.max_density_error, error);
+    n_fluid++;
+  }
+  if (n_fluid > 0) result.density_error /= n_fluid;
+  delete w;
+
+  auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start);
+  result.wall_time = duration.count() / 1e6;
+  return result;
+}
+
+void run_sweep(std::string filename, SweepOptions options, std::function<void(World *)> configure) {
+  std::vector<SweepConfig> configs = parse_sweep_file(filename);
+  int n = configs.size();
+  std::vector<SweepResult> results(n);
+  AsyncWriter *writer = options.data_file_out || options.analysis ? new AsyncWriter(256 << 20) : nullptr;
+
+  int threads_per_run = std::max(1, options.threads_per_run);
+  int concurrent_runs = std::max(1, omp_get_max_threads() / threads_per_run);
+  omp_set_max_active_levels(threads_per_run > 1 ? 2 : 1);
+  printf("Sweep [%d runs] [%d concurrent] [%d threads per run]\n", n, concurrent_runs, threads_per_run);
+
+  auto start = std::chrono::high_resolution_clock::now();
+  int finished = 0;
+  #pragma omp parallel for schedule(dynamic, 1) num_threads(concurrent_runs)
+  for (int i = 0; i < n; i++) {
+    omp_set_num_threads(threads_per_run);
+    std::string output_filename = options.output_prefix + "_" + std::to_string(i) + ".data";
+    std::string analysis_filename = options.analysis_filename;
+    size_t extension = analysis_filename.rfind('.');
+    if (extension == std::string::npos || analysis_filename.find('/', extension) != std::string::npos) extension = analysis_filename.size();
+    analysis_filename.insert(extension, "_" + std::to_string(i));
+    results[i] = run_config(configs[i], options, output_filename, analysis_filename, writer, configure);
+    #pragma omp critical
+    {
+      finished++;
+      printf("[Run %d/%d] [#%d %s] [%.2fs]\n", finished, n, i, configs[i].scene.c_str(), results[i].wall_time);
+    }
+  }
+  delete writer;
+  auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start);
+  double wall_time = duration.count() / 1e6;
+
+  // Report
+  long total_steps = 0;
+  double run_time = 0.0;
+  printf("\n%4s  %-24s %5s %8s %8s %9s %-6s %6s %8s %8s %8s\n",
+         "#", "scene", "scale", "rho_0", "max_dt", "tolerance", "solver", "steps", "wall(s)", "err(%)", "max(%)");
+  for (int i = 0; i < n; i++) {
+    SweepConfig &c = configs[i];
+    SweepResult &r = results[i];
+    printf("%4d  %-24s %5d %8.1f %8.5f %9.6f %-6s %6d %8.3f %8.4f %8.4f\n",
+           i, c.scene.c_str(), c.scale, c.rho_0, c.max_dt, c.tolerance, c.solver.c_str(),
+           r.steps, r.wall_time, 100 * r.density_error, 100 * r.max_density_error);
+    total_steps += r.steps;
+    run_time += r.wall_time;
+  }
+  printf("\n[Runs %d] [Wall Time %.3fs] [Runs/s %.2f] [Steps/s %.0f] [Concurrency %.2f]\n",
+         n, wall_time, n / wall_time, total_steps / wall_time, run_time / wall_time);
+}
@@ -0,0 +1,53 @@
+#ifndef __SPH_SWEEP
+#define __SPH_SWEEP
+
+#include "types.h"
+#include "analysis.h"
+#include <functional>
+#include <string>
+#include <vector>
+
+// Parameter sweep: many small worlds run concurrently in one process, one
+// world per OpenMP thread (or threads_per_run threads with nested
+// parallelism), scheduled dynamically.
+//
+// The sweep file lists the values of each parameter, one parameter per line,
+// and every combination is run:
+//   # comment
+//   scene     scenes/wells.txt scenes/dam.txt
+//   scale     1 2
+//   rho_0     1000
+//   max_dt    0.005 0.001
+//   tolerance 0.001 0.0001
+//   solver    iisph dfsph
+// Missing parameters take the defaults of a single run.
+
+typedef struct {
+  std::string scene;
+  int scale;
+  double rho_0;
+  double max_dt;
+  double tolerance;
+  std::string solver;
+} SweepConfig;
+
+typedef struct {
+  int iters;          // Steps of each run, when target_time < 0
+  double target_time;
+  double save_interval;
+  bool data_file_out;
+  uint8_t output_flags;
+  std::string output_prefix; // Run i is saved to <prefix>_<i>.data
+  int threads_per_run;
+  int depth;
+  double sound_speed;
+  Analysis *analysis;            // Statistics of run i go to analysis_filename
+  std::string analysis_filename; // with _<i> before the extension
+  int analysis_every;
+} SweepOptions;
+
+std::vector<SweepConfig> parse_sweep_file(std::string filename);
+// configure is applied to every world after it is created
+void run_sweep(std::string filename, SweepOptions options, std::function<void(World *)> configure);
+
+#endif
@@ -0,0 +1,87 @@
+#include "tasks.h"
+#include "types.h"
+#include <algorithm>
+#include <cstdio>
+#include <omp.h>
+
+const int TIMELINE_WIDTH = 40;
+
+TaskGraph::TaskGraph() {
+  last_duration = 0;
+  last_threads = 0;
+}
+
+bool conflicts(const std::vector<const void *> &a, const std::vector<const void *> &b) {
+  for (const void *tag: a) {
+    if (std::find(b.begin(), b.end(), tag) != b.end()) return true;
+  }
+  return false;
+}
+
+void TaskGraph::add(std::string name, std::vector<const void *> in, std::vector<const void *> out, std::function<void()> body) {
+  Task task = {name, body, in, out};
+  // The same rule as the depend clauses: writes wait for reads and writes,
+  // reads wait for writes
+  for (size_t i = 0; i < tasks.size(); i++) {
+    if (conflicts(out, tasks[i].in) || conflicts(out, tasks[i].out) || conflicts(in, tasks[i].out)) {
+      task.after.push_back(i);
+    }
+  }
+  tasks.push_back(task);
+}
+
+bool TaskGraph::empty() {
+  return tasks.empty();
+}
+
+void TaskGraph::run(World *w) {
+  auto start = std::chrono::high_resolution_clock::now();
+  auto since_start = [&]() {
+    auto now = std::chrono::high_resolution_clock::now();
+    return (uint64_t) std::chrono::duration_cast<std::chrono::microseconds>(now - start).count();
+  };
+
+  #pragma omp parallel
+  #pragma omp single
+  {
+    last_threads = omp_get_num_threads();
+    for (Task &task: tasks) {
+      Task *t = &task;
+      int n_in = t->in.size(), n_out = t->out.size();
+      const char **in = (const char **) t->in.data();
+      const char **out = (const char **) t->out.data();
+      #pragma omp task firstprivate(t) depend(iterator(k = 0:n_in), in: *in[k]) depend(iterator(k = 0:n_out), inout: *out[k])
+      {
+        t->thread = omp_get_thread_num();
+        t->start = since_start();
+        t->body();
+        t->end = since_start();
+      }
+    }
+  }
+
+  last_duration = since_start();
+  for (Task &task: tasks) {
+    w->timings[task.name].add(task.end - task.start);
+  }
+  last.swap(tasks);
+  tasks.clear();
+}
+
+void TaskGraph::print_timeline() {
+  if (last.empty()) return;
+  double scale = (double) TIMELINE_WIDTH / std::max<uint64_t>(last_duration, 1);
+  printf("[Tasks %lluus on %d threads]\n", (unsigned long long) last_duration, last_threads);
+  for (Task &task: last) {
+    char bar[TIMELINE_WIDTH + 1];
+    int from = std::min<int>(task.start * scale, TIMELINE_WIDTH - 1);
+    int to = std::max<int>(from + 1, std::min<int>(task.end * scale, TIMELINE_WIDTH));
+    for (int i = 0; i < TIMELINE_WIDTH; i++) bar[i] = (from <= i && i < to) ? '#' : ' ';
+    bar[TIMELINE_WIDTH] = 0;
+    printf("  %-14s t%-3d |%s| %6lluus", task.name.c_str(), task.thread, bar, (unsigned long long) (task.end - task.start));
+    for (size_t k = 0; k < task.after.size(); k++) {
+      printf("%s%s", k == 0 ? "  after " : ", ", last[task.after[k]].name.c_str());
+    }
+    printf("\n");
+  }
+}
@@ -0,0 +1,49 @@
+#ifndef __SPH_TASKS
+#define __SPH_TASKS
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+class World;
+
+// Dependency graph of work between steps. Each task names the data it reads
+// and writes (any address works as the tag), and run() executes the tasks as
+// OpenMP tasks with depend clauses: a task waits only for the earlier tasks
+// it conflicts with, instead of everything before it. Task bodies run on one
+// thread (a parallel loop inside a task isn't split), so the graph suits the
+// serial work around a step, e.g. writing frame n while the cells of step
+// n + 1 are built.
+class TaskGraph {
+  typedef struct {
+    std::string name;
+    std::function<void()> body;
+    std::vector<const void *> in;
+    std::vector<const void *> out;
+    std::vector<int> after; // Earlier tasks it conflicts with
+    // Of the last run, µs since its start
+    int thread;
+    uint64_t start;
+    uint64_t end;
+  } Task;
+
+  std::vector<Task> tasks;
+  // Timeline of the last run
+  std::vector<Task> last;
+  uint64_t last_duration;
+  int last_threads;
+
+public:
+  TaskGraph();
+  void add(std::string name, std::vector<const void *> in, std::vector<const void *> out, std::function<void()> body);
+  bool empty();
+  // Runs the tasks added since the last run, and adds their durations to the
+  // world's timings
+  void run(World *w);
+  // Gantt chart of the last run: a row per task with its thread, time span
+  // and the tasks it waited for
+  void print_timeline();
+};
+
+#endif
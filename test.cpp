@@ -3,8 +3,87 @@
 #include "vec2.h"
 #include "iisph.h"
 #include "kernel.h"
+#include <algorithm>
+#include <cassert>
 #include <iostream>
 
-int main() {
+GridId cell(int x, int y) {
+#if SPH_DIM == 3
+  return {x, y, -y};
+#else
+  return {x, y};
+#endif
+}
+
+bool is_used(GridHashMap &map, GridBox *box) {
+  const std::vector<GridBox*> &used = map.used_boxes();
+  return std::find(used.begin(), used.end(), box) != used.end();
+}
+
+// Cells mirrored through the origin get boxes of their own, and remove()
+// takes emptied boxes out of the used ones
+void test_grid_hash_map() {
+  Particle ps[5];
+  for (int i = 0; i < 5; i++) ps[i].idx = i;
+  GridHashMap map(64);
+
+  GridBox *a = map.insert(&ps[0], cell(-1, -1));
+  GridBox *b = map.insert(&ps[1], cell(1, 1));
+  GridBox *c = map.insert(&ps[2], cell(-2, 3));
+  GridBox *d = map.insert(&ps[3], cell(2, -3));
+  assert(map.insert(&ps[4], cell(-1, -1)) == a);
+  assert(a != b && a != c && a != d && b != c && b != d && c != d);
+  assert(map.used_boxes().size() == 4);
+
+  assert(map.find_grid(cell(-1, -1)) == a);
+  assert(map.find_grid(cell(1, 1)) == b);
+  assert(map.find_grid(cell(-2, 3)) == c);
+  assert(map.find_grid(cell(2, -3)) == d);
+  assert(map.find_grid(cell(0, 0)) == nullptr);
+  assert(map.find_grid(cell(1, -1)) == nullptr);
+  assert(map.find_grid(cell(2, 3)) == nullptr);
+  assert(a->particles.size() == 2 && b->particles.size() == 1);
+
+  // Still one particle in a
+  map.remove(&ps[0], a);
+  assert(a->particles.size() == 1 && a->particles[0] == &ps[4]);
+  assert(is_used(map, a));
 
+  // b empties, its box stays placed for the probe chains
+  map.remove(&ps[1], b);
+  assert(map.find_grid(cell(1, 1)) == b && b->particles.empty());
+  assert(b->index == -1 && !is_used(map, b));
+  assert(map.used_boxes().size() == 3);
+  for (GridBox *box: map.used_boxes()) {
+    assert(map.used_boxes()[box->index] == box);
+  }
+
+  // Back into the emptied box
+  assert(map.insert(&ps[1], cell(1, 1)) == b);
+  assert(is_used(map, b) && map.used_boxes().size() == 4);
+}
+
+void test_remap_particle_array() {
+  size_t capacity = 4;
+  double *data = first_touch_array<double>(capacity);
+  for (int i = 0; i < 4; i++) data[i] = 10 + i;
+
+  // Particle 1 removed: compacted in place
+  double *before = data;
+  remap_particle_array(data, capacity, {0, 2, 3});
+  assert(data == before && capacity == 4);
+  assert(data[0] == 10 && data[1] == 12 && data[2] == 13);
+
+  // Three new particles: past the capacity, which doubles
+  remap_particle_array(data, capacity, {0, 1, 2, -1, -1, -1});
+  assert(capacity == 8);
+  assert(data[0] == 10 && data[1] == 12 && data[2] == 13);
+  assert(data[3] == 0 && data[4] == 0 && data[5] == 0);
+  first_touch_free(data);
+}
+
+int main() {
+  test_grid_hash_map();
+  test_remap_particle_array();
+  std::cout << "Tests passed" << std::endl;
 }
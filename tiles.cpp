@@ -0,0 +1,134 @@
+#include "tiles.h"
+#include <cstdlib>
+#include <limits>
+
+const int TILE_ARRAYS = 3 * SPH_DIM + 5;
+
+CellTile::CellTile() {
+  capacity = 0;
+  block = nullptr;
+  n = 0;
+  n_cell = 0;
+}
+
+CellTile::~CellTile() {
+  free(block);
+}
+
+void CellTile::reserve(size_t count) {
+  if (count <= capacity) return;
+  free(block);
+  // Whole cache lines per array
+  capacity = (std::max(count, 2 * capacity) + 7) / 8 * 8;
+  block = (double *) aligned_alloc(64, TILE_ARRAYS * capacity * sizeof(double));
+
+  double *next = block;
+  for (int d = 0; d < SPH_DIM; d++, next += capacity) pos[d] = next;
+  for (int d = 0; d < SPH_DIM; d++, next += capacity) field[d] = next;
+  for (int d = 0; d < SPH_DIM; d++, next += capacity) vel[d] = next;
+  mass = next; next += capacity;
+  rho = next; next += capacity;
+  boundary = next; next += capacity;
+  r2 = next; next += capacity;
+  scalar = next;
+}
+
+void CellTile::gather(Grid *grid, GridBox *box) {
+  GridBox *boxes[27];
+  int n_boxes = grid->get_neighbour_boxes(box, boxes);
+
+  // The cell first
+  particles.assign(box->particles.begin(), box->particles.end());
+  for (int b = 0; b < n_boxes; b++) {
+    if (boxes[b] == box) continue;
+    particles.insert(particles.end(), boxes[b]->particles.begin(), boxes[b]->particles.end());
+  }
+  n = particles.size();
+  n_cell = box->particles.size();
+  reserve(n);
+  phase.resize(n);
+
+  for (int k = 0; k < n; k++) {
+    Particle *p = particles[k];
+    pos[0][k] = p->pos.x;
+    pos[1][k] = p->pos.y;
+#if SPH_DIM == 3
+    pos[2][k] = p->pos.z;
+#endif
+    mass[k] = p->mass;
+    rho[k] = p->rho;
+    boundary[k] = p->boundary_particle ? 1.0 : 0.0;
+    phase[k] = p->phase;
+  }
+}
+
+void CellTile::gather_scalar(const double *values) {
+  for (int k = 0; k < n; k++) {
+    scalar[k] = values[particles[k]->idx];
+  }
+}
+
+void CellTile::gather_vec(const vec *values) {
+  for (int k = 0; k < n; k++) {
+    const vec &v = values[particles[k]->idx];
+    field[0][k] = v.x;
+    field[1][k] = v.y;
+#if SPH_DIM == 3
+    field[2][k] = v.z;
+#endif
+  }
+}
+
+void CellTile::gather_velocity() {
+  for (int k = 0; k < n; k++) {
+    const vec &v = particles[k]->vel;
+    vel[0][k] = v.x;
+    vel[1][k] = v.y;
+#if SPH_DIM == 3
+    vel[2][k] = v.z;
+#endif
+  }
+}
+
+void CellTile::distances_sq(int i) {
+  double xi = pos[0][i], yi = pos[1][i];
+  const double *x = pos[0], *y = pos[1];
+#if SPH_DIM == 3
+  double zi = pos[2][i];
+  const double *z = pos[2];
+  #pragma omp simd aligned(x, y, z: 64)
+  for (int k = 0; k < n; k++) {
+    r2[k] = (x[k] - xi) * (x[k] - xi) + (y[k] - yi) * (y[k] - yi) + (z[k] - zi) * (z[k] - zi);
+  }
+#else
+  #pragma omp simd aligned(x, y: 64)
+  for (int k = 0; k < n; k++) {
+    r2[k] = (x[k] - xi) * (x[k] - xi) + (y[k] - yi) * (y[k] - yi);
+  }
+#endif
+  r2[i] = std::numeric_limits<double>::infinity();
+}
+
+vec CellTile::position(int k) {
+#if SPH_DIM == 3
+  return {pos[0][k], pos[1][k], pos[2][k]};
+#else
+  return {pos[0][k], pos[1][k]};
+#endif
+}
+
+vec CellTile::vector(int k) {
+#if SPH_DIM == 3
+  return {field[0][k], field[1][k], field[2][k]};
+#else
+  return {field[0][k], field[1][k]};
+#endif
+}
+
+vec CellTile::velocity(int k) {
+#if SPH_DIM == 3
+  return {vel[0][k], vel[1][k], vel[2][k]};
+#else
+  return {vel[0][k], vel[1][k]};
+#endif
+}
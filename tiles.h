@@ -0,0 +1,57 @@
+#ifndef __SPH_TILES
+#define __SPH_TILES
+
+#include "types.h"
+
+// Cell centric traversal: the particles of a cell and its neighbour cells
+// (3x3, 3x3x3 in 3D) copied once into contiguous arrays, so that the cell's
+// particles sum over them without chasing particle pointers, and the
+// distance loops vectorise.
+//
+//   CellTile tile;
+//   #pragma omp for
+//   for (GridBox *box: boxes) {
+//     tile.gather(grid, box);
+//     for (int i = 0; i < tile.n_cell; i++) {
+//       tile.distances_sq(i);
+//       for (int k = 0; k < tile.n; k++) if (tile.r2[k] < h²) ...
+//
+// A tile is per thread. Arrays are cache line aligned and only grow.
+class CellTile {
+  size_t capacity;
+  double *block;
+  void reserve(size_t n);
+
+public:
+  int n;      // Particles of the neighbourhood
+  int n_cell; // The cell's own particles, which come first
+  std::vector<Particle*> particles;
+  std::vector<uint8_t> phase;
+  double *pos[SPH_DIM]; // Coordinates
+  double *mass;
+  double *rho;
+  double *boundary;     // 1 for boundary particles
+  double *r2;           // distances_sq()
+  double *scalar;       // gather_scalar()
+  double *field[SPH_DIM]; // gather_vec()
+  double *vel[SPH_DIM];   // gather_velocity()
+
+  CellTile();
+  ~CellTile();
+  CellTile(const CellTile &) = delete;
+  CellTile &operator=(const CellTile &) = delete;
+
+  void gather(Grid *grid, GridBox *box);
+  // values[idx] of the tile's particles
+  void gather_scalar(const double *values);
+  void gather_vec(const vec *values);
+  void gather_velocity();
+  // r2[k] = |x_i - x_k|², with r2[i] = ∞ so that the particle isn't its own
+  // neighbour
+  void distances_sq(int i);
+  vec position(int k);
+  vec vector(int k);
+  vec velocity(int k);
+};
+
+#endif
@@ -2,60 +2,171 @@
 #define __SPH_TYPES
 
 #include "vec2.h"
+#include "vec3.h"
+#include "affinity.h"
+#include <algorithm>
 #include <chrono>
+#include <ostream>
 #include <cstdint>
+#include <deque>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
+// Dimension of the simulation, fixed at compile time (-DSPH_DIM=3)
+#ifndef SPH_DIM
+#define SPH_DIM 2
+#endif
+
+#if SPH_DIM == 3
+typedef vec3 vec;
+#else
+typedef vec2 vec;
+#endif
+
 typedef struct Particle {
   int idx;
   char symbol;
-  vec2 pos;
-  vec2 vel;
+  vec pos;
+  vec vel;
   double mass;
 
   double rho;
   bool boundary_particle;
+  uint8_t phase; // Index into World::phases, 0 for boundary particles
 } Particle;
 
+typedef std::vector<Particle, FirstTouchAllocator<Particle>> ParticleVector;
+
 const double SUPPORT_RADIUS = 1.0 / 24;
 const double SPACING = SUPPORT_RADIUS / 1.2;
 const double PI = 3.1415926539;
 
+// A fluid of the scene, the particles drawn with symbol. Particle masses
+// follow from the rest density, so that each phase starts at its own.
+typedef struct {
+  char symbol;
+  double rho_0;
+  double viscosity; // Kinematic viscosity ν
+} Phase;
+
+// Inflow: a layer of fluid particles (the lattice positions of face) with
+// velocity vel is added every time the last layer has moved one spacing
+typedef struct {
+  char symbol;
+  std::vector<vec> face;
+  vec vel;
+  double distance; // Moved by the last layer
+} Emitter;
+
+// Outflow: fluid particles inside the box (x, y) are removed
+typedef struct {
+  vec min;
+  vec max;
+} Sink;
+
 typedef struct {
   int x;
   int y;
+#if SPH_DIM == 3
+  int z;
+#endif
 } GridId;
 
 typedef struct GridBox {
   GridId grid_id;
   std::vector<Particle*> particles;
   bool used;
+  int index; // In the map's used boxes, -1 while empty
 
-  GridBox(): grid_id({0}), particles(std::vector<Particle*>()), used(false) {}
+  GridBox(): grid_id({0}), particles(std::vector<Particle*>()), used(false), index(-1) {}
 } GridBox;
 
 class Neighbours;
 
+// Open addressing (linear probing) of the non empty cells
 class GridHashMap {
   GridBox *grid_hash_map;
   int size;
+  // Occupancy: boxes placed in the map and the probes past the home box it
+  // took to place them, and the non empty ones among them. A box that
+  // empties stays placed until clear(), keeping the probe chains intact.
+  std::vector<GridBox*> placed;
+  std::vector<GridBox*> used;
+  long probe_sum;
+  int probe_max;
   public:
   GridHashMap(int size);
+  ~GridHashMap();
+  int get_size();
+  // Reallocates empty with size boxes
+  void resize(int size);
   void clear();
-  void insert(Particle *p);
+  // Adds the particle to the box of cell id, which is returned
+  GridBox *insert(Particle *p, GridId id);
+  void remove(Particle *p, GridBox *box);
+  // The cell's box, nullptr if it had no particles since clear() (boxes that
+  // emptied are returned with none). Doesn't modify the map, so it's safe
+  // from parallel loops.
   GridBox* find_grid(GridId grid_id);
+  // Boxes of the non empty cells
+  const std::vector<GridBox*> &used_boxes();
+  double load_factor();
+  double mean_probe_length();
+  int max_probe_length();
 };
 
 class Grid {
-  std::vector<Particle> *particles;
+  ParticleVector *particles;
   GridHashMap grid_hash_map;
+  // Verlet list of particles within h + skin (CSR), and the positions it
+  // was built at. Valid until some particle moves more than skin/2. Each row
+  // has the neighbours j < i first, the ones j > i from list_upper[i].
+  std::vector<int> list_start;
+  std::vector<int> list_upper;
+  std::vector<Particle*> list;
+  std::vector<vec> list_pos;
+  bool list_valid;
+  void build_list();
+  // Box (and its cell) of each particle, and the particles that changed
+  // cells. Moves them, unless more than rebuild_fraction did (returns false).
+  std::vector<GridBox*> particle_box;
+  std::vector<GridId> particle_cell;
+  std::vector<int> changed;
+  bool move_changed();
   friend class NeighbourIterator;
 
  public:
-  Grid(std::vector<Particle> *particles);
+  double skin; // 0 rebuilds the cells every step and uses no list
+  // Width of the cells, at least h + skin (default 2h), and boxes of the
+  // hash map per particle (default 10). Changes apply from the next build().
+  double cell_size;
+  int hash_factor;
+  int rebuilds;
+  // Update the cells by moving only the particles that changed cells
+  // (boxes left empty stay in the map until the next full rebuild)
+  bool incremental;
+  double rebuild_fraction;
+  int moved; // By the last update, -1 if it was a full rebuild
+
+  Grid(ParticleVector *particles);
+  // Rebuilds the cells (the hash map grows with the particles' capacity)
+  // and invalidates the list
   void build();
+  // Rebuild the cells and the list if needed, returns true if rebuilt
+  bool update();
+  GridHashMap *get_hash_map();
   Neighbours get_neighbours(Particle *p);
+  // Neighbours through the cells only, for positions that aren't particles
+  // (the cells of the last rebuild still cover h)
+  Neighbours get_cell_neighbours(Particle *p);
+  // Each pair once: the neighbours j > i of the list or, without it, the
+  // particles after p in its cell and those of the forward half of the
+  // neighbour cells
+  Neighbours get_half_neighbours(Particle *p);
+  // The non empty boxes of the box's cell and its neighbour cells (at most
+  // 27), returns their count
+  int get_neighbour_boxes(GridBox *box, GridBox **boxes);
 };
 
 class NeighbourIterator{
@@ -63,15 +174,16 @@ class NeighbourIterator{
   Particle *particle;
 
   GridId particle_grid_id;
-  int grid_iter_i; // 0 to 8 representing neighbouring cells
+  int grid_iter_i; // 0 to 8 (26 in 3D) representing neighbouring cells
   // iterators inside the grid
   std::vector<Particle*>::const_iterator particle_iter;
   std::vector<Particle*>::const_iterator particle_iter_end;
 
   bool is_end;
+  bool half;
   bool find_next_grid();
 public:
-  NeighbourIterator(Grid *g, Particle *p, bool is_end);
+  NeighbourIterator(Grid *g, Particle *p, bool is_end, bool use_list, bool half);
   // Equality comparison (with end)
   bool operator==(const NeighbourIterator& other) const;
   // Inequality comparision (with end)
@@ -85,22 +197,51 @@ public:
 class Neighbours {
   Grid *grid;
   Particle *particle;
+  bool use_list;
+  bool half;
 public:
 
-  Neighbours(Grid *g, Particle *p);
+  Neighbours(Grid *g, Particle *p, bool use_list, bool half);
   NeighbourIterator begin();
   NeighbourIterator end();
 };
 
 class World;
+class TaskGraph;
+class PerfCounters;
 
 class Algorithm {
 public:
+  virtual ~Algorithm() {}
   virtual double *get_pressure() = 0;
   virtual void initialize(World *w) = 0;
   virtual double physics_update() = 0;
+  // Particles were added or removed, particle i was particle old_index[i]
+  // (-1 if new)
+  virtual void particles_changed(const std::vector<int> &old_index) = 0;
 };
 
+// Moves the values of a per particle array with the particles after they
+// changed, new particles get T{}. The array grows by doubling its capacity
+// when the particles don't fit, otherwise it's updated in place (removed
+// particles are compacted so old_index[i] >= i).
+template <class T>
+void remap_particle_array(T *&data, size_t &capacity, const std::vector<int> &old_index) {
+  size_t n = old_index.size();
+  T *result = data;
+  if (n > capacity) {
+    capacity = std::max(n, 2 * capacity);
+    result = first_touch_array<T>(capacity);
+  }
+  for (size_t i = 0; i < n; i++) {
+    result[i] = old_index[i] < 0 ? T{} : data[old_index[i]];
+  }
+  if (result != data) {
+    first_touch_free(data);
+    data = result;
+  }
+}
+
 class Timing {
 private:
   int current;
@@ -109,9 +250,10 @@ private:
   int count;
   std::chrono::high_resolution_clock::time_point start_point;
   bool started;
-  void add(uint64_t value);
 public:
   Timing();
+  // A duration (µs) measured elsewhere
+  void add(uint64_t value);
   uint64_t get_current();
   double get_std();
   double get_mean();
@@ -124,27 +266,135 @@ const uint8_t SIM_MASS          = 0b00010;
 const uint8_t SIM_BOUNDARY      = 0b00100;
 const uint8_t SIM_PRESSURE      = 0b01000;
 const uint8_t SIM_VELOCITY      = 0b10000;
+const uint8_t SIM_3D            = 0b100000;
+const uint8_t SIM_DENSITY       = 0b1000000;
+// Frames hold a selection of the fluid particles (a bitmask of the selected
+// ones, then their channels) and the header holds the initial positions of
+// all particles
+const uint8_t SIM_SELECTION     = 0b10000000;
+
+// Particles written to the frames of SIM_SELECTION files
+typedef struct {
+  int stride = 1;   // Every stride-th fluid particle
+  bool roi = false; // Only particles inside the box [roi_min, roi_max] (x, y)
+  vec roi_min;
+  vec roi_max;
+} OutputSelection;
 
 class World {
   uint8_t output_flags;
+  bool particle_set_changed = false; // Since the last frame
+  int steps = 0;
+  bool neighbours_updated = false; // Cells already built for this step
+  void append_particle_set(std::string &buffer);
+
+  // State to roll back to
+  typedef struct {
+    std::vector<Particle> particles;
+    double time;
+    int steps;
+    std::vector<Emitter> emitters;
+  } Snapshot;
+  std::deque<Snapshot> snapshots;
+  int steps_since_snapshot = 0;
+  // Rollbacks since the run got past the latest failed step's time
+  int rollbacks_in_row = 0;
+  double failed_time = -1.0;
+  double user_max_dt = 0.0;   // max_dt before the rollbacks halved it, 0 if not
+  void take_snapshot();
+  void rollback(std::string problem);
 
 public:
   double rho_0 = 1000.0;
   double time = 0.0;
-  std::vector<Particle> particles;
+  double max_dt = 0.005;
+  double tolerance = 0.001;     // Average residual of the pressure solvers, in ρ₀
+  int max_pressure_iters = 100; // Iteration cap of the pressure solvers
+  double pressure_omega = 0.5;  // IISPH relaxed Jacobi weight Ω
+  // Evaluate pair terms once over Grid::get_half_neighbours()
+  bool symmetric = false;
+  // Cell centric traversal through CellTile (density and IISPH pressure)
+  bool tiled = false;
+
+  // Non pressure forces
+  vec gravity = {0, -9.81};
+  double viscosity = 0.0;       // Kinematic viscosity ν
+  double xsph = 0.0;            // XSPH velocity smoothing ε
+  double surface_tension = 0.0; // Cohesion coefficient γ
+  // Fluid phases. Phase 0 is the default fluid, of the symbols without a
+  // phase and of the boundary, with rest density rho_0 and the viscosity
+  // above (kept in sync by update_phases(), at the start of every step).
+  std::vector<Phase> phases;
+  // ρ₀ of phase a / ρ₀ of phase b at [a * phases.size() + b]. A phase b
+  // neighbour adds its mass times this to the density of a phase a particle,
+  // which is the number density formulation ρᵢ = ρ₀ᵢ ∑ⱼ Vⱼ W_ij with rest
+  // volumes Vⱼ = mⱼ / ρ₀ⱼ (all 1 with a single phase).
+  std::vector<double> phase_density_ratio;
+  // Per step results of compute_density_and_forces()
+  vec *viscous_acc;
+  vec *xsph_dv;
+  bool has_nonpressure_forces = false;
+
+  ParticleVector particles;
   Grid *grid;
   Algorithm *alg;
-  std::vector<std::pair<std::string, double>> logs;
+  std::vector<std::pair<const char *, double>> logs;
   std::unordered_map<std::string, Timing> timings;
+  // Hardware counters of the timed phases (owned), nullptr for timings only
+  PerfCounters *perf = nullptr;
+  // Per step temporaries of the algorithm, reset before every step
+  ScratchArena scratch;
+
+  // Inflow and outflow, applied after each step
+  std::vector<Emitter> emitters;
+  std::vector<Sink> sinks;
+  size_t max_particles = 0; // Emitters pause at this count (0: no limit)
+  int sink_interval = 10;   // Steps between removals of the sinks' particles
+
+  // Health monitor: after every step, fails on NaN or Inf, or a fluid
+  // particle past the density error or speed limit. A failed step is rolled
+  // back to the newest snapshot (of the last healthy steps) and retried with
+  // max_dt halved. Repeated failures go back to older snapshots. Once past
+  // the failure, every snapshot_interval healthy steps double it back, up
+  // to its old value. More than max_rollbacks failures before getting past
+  // it end the run with an error.
+  bool health = false;
+  double health_density_error = 0.5; // |ρ - ρ₀| / ρ₀
+  double health_velocity = 50.0;
+  int snapshot_interval = 10; // Healthy steps between snapshots
+  int max_snapshots = 3;
+  int max_rollbacks = 8;
 
   World(std::vector<Particle> particles, Algorithm *alg);
-
-  vec2 viscous_acceleration(Particle &p);
-  vec2 external_acceleration(Particle &p);
-  void physics_update();
+  ~World();
+
+  // Adds (or redefines) the phase of the fluid particles drawn with
+  // symbol, rescaling their masses to its rest density. Returns its index.
+  int add_phase(Phase phase);
+  // Phase of the particles drawn with symbol
+  int phase_of(char symbol);
+  // Syncs phase 0 and the density ratios, and caches nonpressure_forces()
+  void update_phases();
+  double rest_density(const Particle &p) { return phases[p.phase].rho_0; }
+  // Row of phase_density_ratio of the particle's phase, by neighbour phase
+  const double *density_ratios(const Particle &p) { return &phase_density_ratio[p.phase * phases.size()]; }
+
+  void update_neighbours();
+  // Emits and removes particles, growing the particles by doubling their
+  // capacity and compacting removed ones
+  void update_flow(double dt);
+  void particles_changed(const std::vector<int> &old_index);
+  // Any viscosity, XSPH or surface tension this step
+  bool nonpressure_forces() { return has_nonpressure_forces; }
+  vec viscous_acceleration(Particle &p);
+  vec external_acceleration(Particle &p);
+  vec xsph_correction(Particle &p);
+  // With a graph, its tasks (the work left from the last step) run first,
+  // alongside rebuilding the cells when that is a serial full rebuild
+  void physics_update(TaskGraph *graph = nullptr);
 
   // Logging
-  void log(std::string param, double value);
+  void log(const char *param, double value);
   void timer_start(std::string name);
   void timer_end(std::string name);
   void print_logs();
@@ -152,16 +402,40 @@ public:
 
 
   // Save to file
-  void write_headers(std::ofstream &file, uint8_t output_flags);
-  void write_frame(std::ofstream &file);
-  void write_footers(std::ofstream &file);
-
-  // Debugging
-  void sanity_checks();
+  OutputSelection selection;
+  void write_headers(std::ostream &file, uint8_t output_flags);
+  void write_frame(std::ostream &file);
+  void write_footers(std::ostream &file);
+  bool selected(Particle &p, int fluid_index);
+
+  // Health monitor check of the current state, what failed or ""
+  std::string check_health();
 };
 
 
-std::vector<Particle> parse_input_file(std::string filename, int parsing_scale);
+// Problems with the file are printed before exiting, or with error set to
+// it and no particles returned
+std::vector<Particle> parse_input_file(std::string filename, int parsing_scale, int depth, bool echo, std::vector<Emitter> &emitters, std::vector<Sink> &sinks, std::string *error = nullptr);
+bool known_solver(std::string solver);
+Algorithm *make_algorithm(std::string solver, double sound_speed);
+// World of the particles (idx, symbol, pos and boundary_particle set), with
+// masses giving each particle the rest density at its initial position
+World *create_world(std::vector<Particle> particles, std::string solver, double sound_speed, double rho_0);
+// With error, a scene that can't be loaded returns nullptr with the reason
+// in it instead of exiting
+World *initialize_world(std::string filename, int parsing_scale, int depth, std::string solver, double sound_speed, double rho_0, bool verbose, std::string *error = nullptr);
+// Draws particles to the terminal as their scene characters. The canvas is
+// sized on the first frame and each frame is written with a single write.
+class TerminalRenderer {
+  bool sized;
+  double x_min, y_top;
+  int x_size, y_size;
+  std::vector<char> canvas;
+public:
+  TerminalRenderer();
+  // pos holds dim floats per particle, only x and y are drawn
+  void render(int n, const float *pos, int dim, const char *symbols, const uint8_t *boundary);
+};
 void render_to_terminal(World *w);
 
 
@@ -1,24 +1,64 @@
 #ifndef __vec2
 #define __vec2
 
-// C++ style
+#include <cmath>
+
+// C++ style. Everything is inline so the compiler can keep vectors in
+// registers and vectorise the neighbour loops.
 struct vec2 {
     double x;
     double y;
-    vec2& operator+=(const vec2& other) {
+    constexpr vec2& operator+=(const vec2& other) {
         x += other.x;
         y += other.y;
         return *this;
     }
+    constexpr vec2& operator-=(const vec2& other) {
+        x -= other.x;
+        y -= other.y;
+        return *this;
+    }
+    constexpr vec2& operator*=(double scalar) {
+        x *= scalar;
+        y *= scalar;
+        return *this;
+    }
 };
-vec2 operator+(vec2 p1, vec2 p2);
-vec2 operator-(vec2 p1, vec2 p2);
-vec2 operator-(vec2 p1);
-vec2 operator*(vec2 p1, double scalar);
-vec2 operator*(double scalar, vec2 p1);
-double dot(vec2 p1, vec2 p2);
-double norm_square(vec2 p);
-double norm(vec2 p);
-double distance(vec2 p1, vec2 p2);
+
+constexpr vec2 operator+(vec2 p1, vec2 p2) {
+  return {p1.x + p2.x, p1.y + p2.y};
+}
+
+constexpr vec2 operator-(vec2 p1, vec2 p2) {
+  return {p1.x - p2.x, p1.y - p2.y};
+}
+
+constexpr vec2 operator-(vec2 p1) {
+  return {-p1.x, -p1.y};
+}
+
+constexpr vec2 operator*(vec2 p1, double scalar) {
+  return {p1.x * scalar, p1.y * scalar};
+}
+
+constexpr vec2 operator*(double scalar, vec2 p1) {
+  return {p1.x * scalar, p1.y * scalar};
+}
+
+constexpr double dot(vec2 p1, vec2 p2) {
+  return p1.x * p2.x + p1.y * p2.y;
+}
+
+constexpr double norm_square(vec2 p) {
+  return p.x * p.x + p.y * p.y;
+}
+
+inline double norm(vec2 p) {
+  return std::sqrt(p.x * p.x + p.y * p.y);
+}
+
+inline double distance(vec2 p1, vec2 p2) {
+  return norm(p1 - p2);
+}
 
 #endif
@@ -0,0 +1,67 @@
+#ifndef __vec3
+#define __vec3
+
+#include <cmath>
+
+// C++ style, inline like vec2
+struct vec3 {
+    double x;
+    double y;
+    double z;
+    constexpr vec3& operator+=(const vec3& other) {
+        x += other.x;
+        y += other.y;
+        z += other.z;
+        return *this;
+    }
+    constexpr vec3& operator-=(const vec3& other) {
+        x -= other.x;
+        y -= other.y;
+        z -= other.z;
+        return *this;
+    }
+    constexpr vec3& operator*=(double scalar) {
+        x *= scalar;
+        y *= scalar;
+        z *= scalar;
+        return *this;
+    }
+};
+
+constexpr vec3 operator+(vec3 p1, vec3 p2) {
+  return {p1.x + p2.x, p1.y + p2.y, p1.z + p2.z};
+}
+
+constexpr vec3 operator-(vec3 p1, vec3 p2) {
+  return {p1.x - p2.x, p1.y - p2.y, p1.z - p2.z};
+}
+
+constexpr vec3 operator-(vec3 p1) {
+  return {-p1.x, -p1.y, -p1.z};
+}
+
+constexpr vec3 operator*(vec3 p1, double scalar) {
+  return {p1.x * scalar, p1.y * scalar, p1.z * scalar};
+}
+
+constexpr vec3 operator*(double scalar, vec3 p1) {
+  return {p1.x * scalar, p1.y * scalar, p1.z * scalar};
+}
+
+constexpr double dot(vec3 p1, vec3 p2) {
+  return p1.x * p2.x + p1.y * p2.y + p1.z * p2.z;
+}
+
+constexpr double norm_square(vec3 p) {
+  return p.x * p.x + p.y * p.y + p.z * p.z;
+}
+
+inline double norm(vec3 p) {
+  return std::sqrt(p.x * p.x + p.y * p.y + p.z * p.z);
+}
+
+inline double distance(vec3 p1, vec3 p2) {
+  return norm(p1 - p2);
+}
+
+#endif
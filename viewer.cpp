@@ -0,0 +1,36 @@
+#include "live.h"
+#include "types.h"
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Renders the frames a running simulator publishes with --live NAME.
+// Can be started and stopped at any time without affecting the simulation.
+int main(int argc, char **argv) {
+  if (argc < 2 || std::string(argv[1]) == "--help") {
+    std::cout << "viewer <name> [fps]" << std::endl;
+    std::cout << "  Attach to a simulator started with --live <name>" << std::endl;
+    return argc < 2;
+  }
+  double fps = argc > 2 ? std::stod(argv[2]) : 30;
+
+  LiveReader reader(argv[1]);
+  TerminalRenderer renderer;
+  std::vector<float> pos;
+  double time;
+  uint64_t frame;
+  auto interval = std::chrono::microseconds((long) (1e6 / fps));
+
+  while (!reader.closed()) {
+    if (reader.latest(pos, time, frame)) {
+      renderer.render(reader.n, pos.data(), reader.dim, reader.symbols.data(), reader.boundary.data());
+      printf("[Frame %llu] [Time %.4fs]\n", (unsigned long long) frame, time);
+    }
+    std::this_thread::sleep_for(interval);
+  }
+  printf("Simulation ended\n");
+  return 0;
+}
@@ -19,7 +19,8 @@
   (vy 0.0 :type short-float)
   (boundary-p nil :type boolean)
   (mass 0.0 :type short-float)
-  (pressure 0.0 :type short-float))
+  (pressure 0.0 :type short-float)
+  (density 0.0 :type short-float))
 
 (defmethod print-object ((o particle) stream)
   (with-slots (x y) o
@@ -131,6 +132,9 @@
 (defconstant +SIM-BOUNDARY+          #b00100)
 (defconstant +SIM-PRESSURE+          #b01000)
 (defconstant +SIM-VELOCITY+          #b10000)
+(defconstant +SIM-3D+                #b100000)
+(defconstant +SIM-DENSITY+           #b1000000)
+(defconstant +SIM-SELECTION+         #b10000000)
 
 (defclass simulation ()
   ((io-buffer :initarg :io-buffer)
@@ -176,14 +180,11 @@
         (replace arr2 arr)
         arr2))))
 
-(defun open-simulation-file (filename &optional buffer)
-  (let* ((io-buffer (or buffer (fast-io:make-input-buffer :vector (read-file-octets filename))))
-         (flags (fast-io:readu8 io-buffer))
-         (little-endian-p (case (logand +sim-little-endian+ flags)
-                            (1 T)
-                            (0 nil)))
-         (sim (make-instance 'simulation :io-buffer io-buffer :little-endian-p little-endian-p :flags flags)))
-    (let* ((count (read-u32 sim))
+(defmethod read-particle-set ((s simulation))
+  "Count, masses, boundary flags and with SELECTION the positions of the
+particles, in the header and after a 2 that starts a frame"
+  (with-slots (io-buffer flags) s
+    (let* ((count (read-u32 s))
            (particles (make-array count
                                   :element-type '(or null particle)
                                   :initial-element nil)))
@@ -192,39 +193,87 @@
                                                 :y 0.0
                                                 :mass (if (= 0 (logand +sim-mass+ flags))
                                                           0.0
-                                                          (read-single sim)))))
+                                                          (read-single s)))))
       (unless (= 0 (logand +sim-boundary+ flags))
         (loop for p across particles do
               (when (= 1 (fast-io:readu8 io-buffer))
                 (setf (particle-boundary-p p) t))))
 
-      (setf (slot-value sim 'header-end-position) (fast-io::input-buffer-pos io-buffer))
+      ;; Initial positions, frames then only hold some of the fluid particles
+      (unless (= 0 (logand +sim-selection+ flags))
+        (loop for p across particles do
+              (setf (particle-x p) (read-single s)
+                    (particle-y p) (read-single s))
+              (unless (= 0 (logand +sim-3d+ flags))
+                (read-single s))))
+      (setf (particles s) particles))))
 
-      (print flags)
-      (setf (particles sim) particles)
-      sim)))
+(defun open-simulation-file (filename &optional buffer)
+  (let* ((io-buffer (or buffer (fast-io:make-input-buffer :vector (read-file-octets filename))))
+         (flags (fast-io:readu8 io-buffer))
+         (little-endian-p (case (logand +sim-little-endian+ flags)
+                            (1 T)
+                            (0 nil)))
+         (sim (make-instance 'simulation :io-buffer io-buffer :little-endian-p little-endian-p :flags flags)))
+    (read-particle-set sim)
+    (setf (slot-value sim 'header-end-position) (fast-io::input-buffer-pos io-buffer))
+    (print flags)
+    sim))
 
 (defmethod reset-simulation ((s simulation))
-  (with-slots (io-buffer header-end-position) s
-    (setf (fast-io::input-buffer-pos io-buffer)
-          header-end-position)
+  ;; Emitters and sinks may have changed the particles, so the header's are
+  ;; read again
+  (with-slots (io-buffer) s
+    (setf (fast-io::input-buffer-pos io-buffer) 1)
+    (read-particle-set s)
     (setf (ended s) nil)
     (setf (frame-number s) 0)))
 
 (defmethod read-frame ((s simulation))
   (if (ended s)
       nil
-      (let ((has-next-frame (read-u8 s))
-            (read-pressure (not (= 0 (logand +sim-pressure+ (flags s))))))
-        (if has-next-frame
-            (progn
-              (setf (world-time s) (read-single s))
-              (loop for p across (particles s) do
-                (setf (particle-x p) (read-single s)
-                      (particle-y p) (read-single s)
-                      (particle-pressure p) (if read-pressure (read-single s) 0.0)))
-              (incf (frame-number s)))
-            (setf (ended s) t))
+      (let* ((flags (flags s))
+             (has-next-frame (loop for marker = (fast-io:readu8 (slot-value s 'io-buffer))
+                                   ;; 2: emitters and sinks changed the particles
+                                   while (= marker 2)
+                                   do (read-particle-set s)
+                                   finally (return (= marker 1))))
+             (read-pressure (not (= 0 (logand +sim-pressure+ flags))))
+             (read-velocity (not (= 0 (logand +sim-velocity+ flags))))
+             (read-density (not (= 0 (logand +sim-density+ flags))))
+             (read-z (not (= 0 (logand +sim-3d+ flags))))
+             (selection (not (= 0 (logand +sim-selection+ flags)))))
+        (flet ((read-particle (p)
+                 ;; x, y, [z], [p], [vx, vy, [vz]], [rho]
+                 (setf (particle-x p) (read-single s)
+                       (particle-y p) (read-single s))
+                 ;; 3D frames are drawn projected on the x-y plane
+                 (when read-z (read-single s))
+                 (setf (particle-pressure p) (if read-pressure (read-single s) 0.0))
+                 (when read-velocity
+                   (setf (particle-vx p) (read-single s)
+                         (particle-vy p) (read-single s))
+                   (when read-z (read-single s)))
+                 (when read-density
+                   (setf (particle-density p) (read-single s)))))
+          (if has-next-frame
+              (progn
+                (setf (world-time s) (read-single s))
+                (if selection
+                    ;; Bitmask of the particles in the frame, the others
+                    ;; keep their last values
+                    (let* ((particles (particles s))
+                           (mask (make-array (ceiling (length particles) 8)
+                                             :element-type '(unsigned-byte 8))))
+                      (fast-io:fast-read-sequence mask (slot-value s 'io-buffer))
+                      (loop for p across particles
+                            for i from 0
+                            when (logbitp (mod i 8) (aref mask (floor i 8)))
+                              do (read-particle p)))
+                    (loop for p across (particles s) do
+                      (read-particle p)))
+                (incf (frame-number s)))
+              (setf (ended s) t)))
         (not (ended s)))))
 
 (defmethod close-simulation ((s simulation)) )
@@ -0,0 +1,151 @@
+#include "types.h"
+#include "kernel.h"
+#include <cassert>
+#include <cmath>
+#include "physics.h"
+#include "wcsph.h"
+
+// Weakly compressible SPH
+//
+// Pressure comes from an equation of state instead of a pressure solve, and
+// density is integrated with the continuity equation. So a step needs a
+// single pass over the neighbours which computes both Dρ/Dt and Dv/Dt.
+
+// Tait equation: p = B ((ρ/ρ₀)^γ - 1), B = ρ₀ c² / γ, with the ρ₀ of the
+// particle's phase
+void wcsph_equation_of_state(World *w, double c, double *P) {
+  const double gamma = 7.0;
+  #pragma omp parallel for
+  for (Particle &p: w->particles) {
+    double rho_0 = w->rest_density(p);
+    double B = rho_0 * c * c / gamma;
+    // Negative pressure (tension) is clamped to avoid particle clumping
+    P[p.idx] = std::max(0.0, B * (std::pow(p.rho / rho_0, gamma) - 1));
+  }
+}
+
+// Dρ/Dt = ∑ⱼ mⱼ (vᵢ - vⱼ) · ∇W_{ij}
+// Dv/Dt = - ∑ⱼ mⱼ (pᵢ/ρᵢ² + pⱼ/ρⱼ² + Πᵢⱼ) ∇W_{ij}
+// where Πᵢⱼ is Monaghan's artificial viscosity. The configured viscosity
+// and cohesion forces are summed in the same pass.
+void wcsph_density_and_forces(World *w, double c, double *P, double *drho_dt, vec *acc) {
+  // Artificial viscosity. With a support radius of only 1.2 particle
+  // spacings the usual 0.01-0.1 is not enough to damp pressure waves.
+  const double alpha = 1.0;
+  const double h = SUPPORT_RADIUS;
+  bool nonpressure = w->nonpressure_forces();
+  if (nonpressure) {
+    w->viscous_acc = w->scratch.alloc_array<vec>(w->particles.size());
+    w->xsph_dv = w->scratch.alloc_array<vec>(w->particles.size());
+  }
+
+  #pragma omp parallel for
+  for (Particle &p: w->particles) {
+    if (p.boundary_particle) continue;
+
+    double pi_term = P[p.idx] / (p.rho * p.rho);
+    double drho = 0.0;
+    vec a = {0};
+    NonPressureSums sums = {0};
+    const double *ratio = w->density_ratios(p);
+    for (Particle *pj: w->grid->get_neighbours(&p)) {
+      vec grad = gradW(p.pos, pj->pos);
+      if (nonpressure) add_nonpressure_terms(&p, pj, W(distance(p.pos, pj->pos)), grad, sums);
+      vec v_ij = p.vel - pj->vel;
+      vec x_ij = p.pos - pj->pos;
+      drho += pj->mass * ratio[pj->phase] * dot(v_ij, grad);
+
+      // Pressure mirroring by boundary particle
+      double pj_term = pj->boundary_particle ? pi_term : P[pj->idx] / (pj->rho * pj->rho);
+      double rho_ij = pj->boundary_particle ? p.rho : 0.5 * (p.rho + pj->rho);
+      double vx = dot(v_ij, x_ij);
+      double viscosity = 0.0;
+      if (vx < 0) {
+        double mu = h * vx / (norm_square(x_ij) + 0.01 * h * h);
+        viscosity = -alpha * c * mu / rho_ij;
+      }
+      a += -pj->mass * (pi_term + pj_term + viscosity) * grad;
+    }
+    drho_dt[p.idx] = drho;
+    acc[p.idx] = a;
+    if (nonpressure) store_nonpressure_terms(w, &p, sums);
+  }
+}
+
+double wcsph_compute_time_step(World *w, double c, vec *acc) {
+  double max_vel_sq = 0.0;
+  double max_acc_sq = 0.0;
+  #pragma omp parallel for reduction(max : max_vel_sq, max_acc_sq)
+  for (Particle &p: w->particles) {
+    if (p.boundary_particle) continue;
+    max_vel_sq = std::max(max_vel_sq, norm_square(p.vel));
+    max_acc_sq = std::max(max_acc_sq, norm_square(acc[p.idx] + w->external_acceleration(p)));
+  }
+  // Sound has to travel less than a support radius per step
+  double cfl_delta = 0.4 * SUPPORT_RADIUS / (c + sqrt(max_vel_sq));
+  double force_delta = max_acc_sq == 0.0 ? 1 : 0.25 * sqrt(SUPPORT_RADIUS / sqrt(max_acc_sq));
+  double dt = std::min(w->max_dt, std::min(cfl_delta, force_delta));
+  w->log("dt", dt);
+  return dt;
+}
+
+WCSPH::WCSPH(double c) {
+  sound_speed = c;
+}
+
+WCSPH::~WCSPH() {
+  if (pressure) first_touch_free(pressure);
+}
+
+void WCSPH::particles_changed(const std::vector<int> &old_index) {
+  remap_particle_array(pressure, capacity, old_index);
+}
+
+double *WCSPH::get_pressure() {
+  return pressure;
+}
+
+double WCSPH::physics_update() {
+  // Update neighbours
+  w->timer_start("Build Grid");
+  w->update_neighbours();
+  w->timer_end("Build Grid");
+
+  w->timer_start("Density,Forces");
+  double *drho_dt = w->scratch.alloc_array<double>(w->particles.size());
+  vec *acc = w->scratch.alloc_array<vec>(w->particles.size());
+  wcsph_equation_of_state(w, sound_speed, pressure);
+  wcsph_density_and_forces(w, sound_speed, pressure, drho_dt, acc);
+  w->timer_end("Density,Forces");
+
+  w->timer_start("dt");
+  double dt = wcsph_compute_time_step(w, sound_speed, acc);
+  w->timer_end("dt");
+
+  // Symplectic Euler
+  w->timer_start("Apply forces");
+  #pragma omp parallel for
+  for (Particle& p: w->particles) {
+    if (!p.boundary_particle) {
+      p.vel += dt * (acc[p.idx] + w->viscous_acceleration(p) + w->external_acceleration(p)) + w->xsph_correction(p);
+      p.pos += dt * p.vel;
+      p.rho += dt * drho_dt[p.idx];
+    }
+  }
+  w->timer_end("Apply forces");
+
+  return dt;
+}
+
+void WCSPH::initialize(World *_w) {
+  w = _w;
+  capacity = w->particles.size();
+  pressure = first_touch_array<double>(capacity);
+
+  // Initial density by summation, afterwards it is integrated
+  #pragma omp parallel for
+  for (Particle& p: w->particles) {
+    p.rho = compute_density(w, &p);
+  }
+  wcsph_equation_of_state(w, sound_speed, pressure);
+}
@@ -0,0 +1,21 @@
+#ifndef __WCSPH
+#define __WCSPH
+
+#include "types.h"
+
+class WCSPH: public Algorithm {
+private:
+  double *pressure = nullptr;
+  size_t capacity;
+  double sound_speed;
+  World *w;
+
+public:
+  WCSPH(double sound_speed);
+  ~WCSPH();
+  virtual double *get_pressure();
+  virtual void initialize(World *w);
+  virtual double physics_update();
+  virtual void particles_changed(const std::vector<int> &old_index);
+};
+#endif
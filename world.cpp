@@ -1,10 +1,16 @@
 #include "types.h"
+#include "tasks.h"
+#include "perf.h"
+#include "kernel.h"
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <bit>
 #include <iostream>
+#include <string>
 #include <utility>
 #include <chrono>
 
@@ -56,10 +62,23 @@ double Timing::get_std() {
 }
 
 World::World(std::vector<Particle> _particles, Algorithm *_alg) {
-  particles = _particles;
+  // Copy into first touched memory
+  particles.assign(_particles.begin(), _particles.end());
+  // Viscosity uses the neighbours' density of the previous step
+  for (Particle &p: particles) {
+    p.rho = rho_0;
+  }
   alg = _alg;
   grid = new Grid(&particles);
-  logs = std::vector<std::pair<std::string, double>>();
+  logs = std::vector<std::pair<const char *, double>>();
+  phases.push_back({'\0', rho_0, viscosity});
+  update_phases();
+}
+
+World::~World() {
+  delete grid;
+  delete alg;
+  delete perf;
 }
 
 void World::timer_start(std::string name) {
@@ -70,9 +89,11 @@ void World::timer_start(std::string name) {
     timings[name] = t;
     timings[name].start();
   }
+  if (perf) perf->start(name);
 }
 
 void World::timer_end(std::string name) {
+  if (perf) perf->end(name);
   if (timings.find(name) != timings.end()) {
     timings[name].end();
   } else {
@@ -81,33 +102,257 @@ void World::timer_end(std::string name) {
   }
 }
 
-vec2 World::viscous_acceleration(Particle &p) {
-  vec2 acc = {0, 0};
-  return acc;
+int World::add_phase(Phase phase) {
+  int index = phase_of(phase.symbol);
+  if (index == 0) {
+    if (phases.size() == 256) {
+      std::cerr << "Too many phases, at most 255 besides the default" << std::endl;
+      exit(1);
+    }
+    index = phases.size();
+    phases.push_back(phase);
+  }
+  double old_rho_0 = phases[index].rho_0;
+  phases[index] = phase;
+  update_phases();
+
+  for (Particle &p: particles) {
+    if (p.boundary_particle || p.symbol != phase.symbol) continue;
+    // From the rest density the mass was set up for
+    double rho_0_before = p.phase == index ? old_rho_0 : rest_density(p);
+    p.phase = index;
+    p.mass *= phase.rho_0 / rho_0_before;
+    p.rho = phase.rho_0;
+  }
+  return index;
+}
+
+int World::phase_of(char symbol) {
+  for (size_t k = 1; k < phases.size(); k++) {
+    if (phases[k].symbol == symbol) return k;
+  }
+  return 0;
+}
+
+void World::update_phases() {
+  phases[0].rho_0 = rho_0;
+  phases[0].viscosity = viscosity;
+  size_t n = phases.size();
+  phase_density_ratio.resize(n * n);
+  for (size_t a = 0; a < n; a++) {
+    for (size_t b = 0; b < n; b++) {
+      phase_density_ratio[a * n + b] = a == b ? 1.0 : phases[a].rho_0 / phases[b].rho_0;
+    }
+  }
+
+  bool phase_viscosity = false;
+  for (Phase &phase: phases) phase_viscosity |= phase.viscosity != 0;
+  has_nonpressure_forces = phase_viscosity || xsph != 0 || surface_tension != 0;
+}
+
+vec World::viscous_acceleration(Particle &p) {
+  vec acc = {0, 0};
+  if (!nonpressure_forces()) return acc;
+  return viscous_acc[p.idx];
 }
 
-vec2 World::external_acceleration(Particle &p) {
-  vec2 acc = {0, 0};
+vec World::external_acceleration(Particle &p) {
+  vec acc = {0, 0};
   if (!p.boundary_particle) {
-    acc.y = -9.81; // Gravity
+    acc = gravity;
   }
   return acc;
 }
 
-void World::physics_update() {
+vec World::xsph_correction(Particle &p) {
+  vec dv = {0, 0};
+  if (!nonpressure_forces()) return dv;
+  return xsph_dv[p.idx];
+}
+
+void World::physics_update(TaskGraph *graph) {
+  if (graph) {
+    // A full rebuild is a serial insert loop, which overlaps with the tasks.
+    // The Verlet list and the incremental update are parallel loops, which
+    // would run on one thread inside a task, so they're left to the step.
+    // So are the solver's phases (dt, aᵢᵢ and sᵢ, ...): each reads the
+    // previous one's result of every particle, and as tasks they would be
+    // serial loops with the same ordering.
+    bool serial_rebuild = grid->skin == 0 && !grid->incremental;
+    if (serial_rebuild) graph->add("Grid Rebuild", {&particles}, {grid}, [this]() { grid->update(); });
+    graph->run(this);
+    neighbours_updated = serial_rebuild;
+  }
+
   logs.clear();
+  scratch.reset();
+  update_phases();
+  if (health && snapshots.empty()) take_snapshot();
   timer_start("Physics");
-  time += alg->physics_update();
+  double dt = alg->physics_update();
+  time += dt;
   timer_end("Physics");
+
+  if (emitters.size() > 0 || sinks.size() > 0) {
+    timer_start("Flow");
+    update_flow(dt);
+    timer_end("Flow");
+  }
+
+  if (health) {
+    timer_start("Health");
+    std::string problem = check_health();
+    if (problem != "") {
+      rollback(problem);
+      log("Rollbacks", rollbacks_in_row);
+    } else if (++steps_since_snapshot >= snapshot_interval) {
+      take_snapshot();
+      if (user_max_dt > 0 && rollbacks_in_row == 0) {
+        max_dt = std::min(2 * max_dt, user_max_dt);
+        if (max_dt == user_max_dt) user_max_dt = 0.0;
+      }
+    }
+    timer_end("Health");
+  }
+}
+
+// Mass of a particle inside a filled lattice, as set up for the scene's
+// fluid by setup_initial_mass()
+double lattice_mass(double rho_0) {
+  double sumW = 0.0;
+  int r = std::ceil(SUPPORT_RADIUS / SPACING);
+  for (int x = -r; x <= r; x++) {
+    for (int y = -r; y <= r; y++) {
+      for (int z = (SPH_DIM == 3 ? -r : 0); z <= (SPH_DIM == 3 ? r : 0); z++) {
+        sumW += W(SPACING * std::sqrt(x * x + y * y + z * z));
+      }
+    }
+  }
+  return rho_0 / sumW;
+}
+
+bool in_sink(Sink &sink, vec pos) {
+  return sink.min.x <= pos.x && pos.x <= sink.max.x && sink.min.y <= pos.y && pos.y <= sink.max.y;
 }
 
-void World::log(std::string param, double value) {
+void World::update_flow(double dt) {
+  steps++;
+
+  // Each emitter adds a layer at the spacing, offset by how far past it the
+  // last layer has moved. A step moves less than a spacing (CFL), so one
+  // layer per step is enough. Positions still occupied (blocked outflow) are
+  // skipped. Checked first, while the cells point to the particles.
+  std::vector<Particle> emitted;
+  for (Emitter &e: emitters) {
+    e.distance += norm(e.vel) * dt;
+    if (e.distance < SPACING) continue;
+    if (max_particles > 0 && particles.size() + emitted.size() + e.face.size() > max_particles) {
+      e.distance = SPACING;
+      continue;
+    }
+    e.distance = std::min(e.distance - SPACING, SPACING);
+    vec offset = (e.distance / norm(e.vel)) * e.vel;
+    int phase = phase_of(e.symbol);
+    double phase_rho_0 = phases[phase].rho_0;
+    double mass = lattice_mass(phase_rho_0);
+    for (vec pos: e.face) {
+      Particle p = {0};
+      p.idx = -1;
+      p.symbol = e.symbol;
+      p.pos = pos + offset;
+      p.vel = e.vel;
+      p.mass = mass;
+      p.rho = phase_rho_0;
+      p.phase = phase;
+      bool occupied = false;
+      for (Particle *pj: grid->get_cell_neighbours(&p)) {
+        if (distance(p.pos, pj->pos) < 0.75 * SPACING) {
+          occupied = true;
+          break;
+        }
+      }
+      if (!occupied) emitted.push_back(p);
+    }
+  }
+
+  // Removal is batched every sink_interval steps, the particles are then
+  // compacted in order so that old_index[i] >= i
+  size_t n = particles.size();
+  std::vector<int> old_index;
+  if (sinks.size() > 0 && steps % sink_interval == 0) {
+    auto removed = [&](Particle &p) {
+      if (p.boundary_particle) return false;
+      for (Sink &sink: sinks) {
+        if (in_sink(sink, p.pos)) return true;
+      }
+      return false;
+    };
+    int n_removed = 0;
+    #pragma omp parallel for reduction(+: n_removed)
+    for (Particle &p: particles) {
+      if (removed(p)) n_removed++;
+    }
+
+    if (n_removed > 0) {
+      old_index.resize(n);
+      size_t kept = 0;
+      for (size_t i = 0; i < n; i++) {
+        if (removed(particles[i])) continue;
+        if (kept != i) particles[kept] = particles[i];
+        particles[kept].idx = kept;
+        old_index[kept] = i;
+        kept++;
+      }
+      particles.resize(kept);
+      old_index.resize(kept);
+    }
+  }
+
+  if (emitted.size() > 0) {
+    if (old_index.empty()) {
+      old_index.resize(n);
+      for (size_t i = 0; i < n; i++) old_index[i] = i;
+    }
+    size_t needed = particles.size() + emitted.size();
+    if (needed > particles.capacity()) {
+      particles.reserve(std::max(needed, 2 * particles.capacity()));
+    }
+    for (Particle &p: emitted) {
+      p.idx = particles.size();
+      particles.push_back(p);
+      old_index.push_back(-1);
+    }
+  }
+
+  if (old_index.size() > 0) particles_changed(old_index);
+  log("Particles", particles.size());
+}
+
+void World::particles_changed(const std::vector<int> &old_index) {
+  // Cells point into particles, which may have moved
+  grid->build();
+  alg->particles_changed(old_index);
+  particle_set_changed = true;
+}
+
+void World::update_neighbours() {
+  if (!neighbours_updated) grid->update();
+  neighbours_updated = false;
+  if (grid->skin > 0) log("Rebuilds", grid->rebuilds);
+  if (grid->incremental) log("Grid Moved", grid->moved);
+  GridHashMap *map = grid->get_hash_map();
+  log("Hash Load", map->load_factor());
+  log("Hash Probes", map->mean_probe_length());
+  log("Hash Max Probes", map->max_probe_length());
+}
+
+void World::log(const char *param, double value) {
   logs.push_back(std::pair(param, value));
 }
 
 void World::print_logs() {
   for (auto log: logs) {
-    printf("[%s %f] ", log.first.c_str(), log.second);
+    printf("[%s %f] ", log.first, log.second);
   }
   if (logs.size() > 0) printf("\n");
 }
@@ -115,75 +360,181 @@ void World::print_logs() {
 void World::print_timings() {
   for (auto log: timings) {
     Timing timing = log.second;
+    std::string counters = perf ? perf->format(log.first) : "";
     if (timing.get_mean() >= 1000) {
-      printf("[%s %4.1fms(± %.0f)] ", log.first.c_str(), (double)timing.get_current() / 1000, (double) timing.get_std() / 1000);
+      printf("[%s %4.1fms(± %.0f)%s] ", log.first.c_str(), (double)timing.get_current() / 1000, (double) timing.get_std() / 1000, counters.c_str());
     } else {
-      printf("[%s %4lluus (± %.0f)] ", log.first.c_str(), log.second.get_current(), log.second.get_std());
+      printf("[%s %4lluus (± %.0f)%s] ", log.first.c_str(), log.second.get_current(), log.second.get_std(), counters.c_str());
     }
   }
   if (timings.size() > 0) printf("\n");
 }
 
-void write_single(std::ofstream &file, float s) {
-  file.write(reinterpret_cast<char *>(&s), sizeof(float));
+void write_byte(std::ostream &file, uint8_t byte) {
+  file.write(reinterpret_cast<const char *>(&byte), sizeof(uint8_t));
 }
 
-void write_byte(std::ofstream &file, uint8_t byte) {
-  file.write(reinterpret_cast<const char *>(&byte), sizeof(uint8_t));
+template <class T>
+void append(std::string &buffer, T value) {
+  buffer.append(reinterpret_cast<const char *>(&value), sizeof(T));
 }
 
+void append_vec(std::string &buffer, vec v) {
+  append<float>(buffer, v.x);
+  append<float>(buffer, v.y);
+#if SPH_DIM == 3
+  append<float>(buffer, v.z);
+#endif
+}
 
-void World::write_headers(std::ofstream &file, uint8_t flags) {
+void World::write_headers(std::ostream &file, uint8_t flags) {
   // Write endianness
   uint8_t little_endian = (std::endian::native == std::endian::little) ? SIM_LITTLE_ENDIAN : 0;
   output_flags = (flags & 0b11111110) | little_endian;
+  if (SPH_DIM == 3) output_flags |= SIM_3D;
 
   printf("Flags = %d\n", output_flags);
   write_byte(file, output_flags);
+  printf("Count: %zu\n", particles.size());
 
-  // Count of particles
-  uint32_t count = particles.size();
-  printf("Count: %d\n", count);
-  file.write(reinterpret_cast<const char*>(&count), sizeof(uint32_t));
+  std::string buffer;
+  append_particle_set(buffer);
+  file.write(buffer.data(), buffer.size());
+  particle_set_changed = false;
+}
 
-  // Mass of particles
+// Count of particles, their masses, whether they are boundary, and with
+// SIM_SELECTION their current positions (the only ones of boundary
+// particles)
+void World::append_particle_set(std::string &buffer) {
+  append<uint32_t>(buffer, particles.size());
   if (output_flags & SIM_MASS) {
     for (Particle& p: particles) {
-      write_single(file, p.mass);
+      append<float>(buffer, p.mass);
     }
   }
-
-  // Boundary or Not
   if (output_flags & SIM_BOUNDARY) {
     for (Particle& p: particles) {
-      write_byte(file, p.boundary_particle);
+      append<uint8_t>(buffer, p.boundary_particle);
+    }
+  }
+  if (output_flags & SIM_SELECTION) {
+    for (Particle& p: particles) {
+      append_vec(buffer, p.pos);
     }
   }
 }
 
-void World::write_frame(std::ofstream &file) {
-  uint8_t next_frame = 1;
-  file.write(reinterpret_cast<char *>(&next_frame), sizeof(uint8_t));
-  write_single(file, time);
+bool World::selected(Particle &p, int fluid_index) {
+  if (p.boundary_particle || fluid_index % selection.stride != 0) return false;
+  if (!selection.roi) return true;
+  return selection.roi_min.x <= p.pos.x && p.pos.x <= selection.roi_max.x &&
+         selection.roi_min.y <= p.pos.y && p.pos.y <= selection.roi_max.y;
+}
+
+void World::write_frame(std::ostream &file) {
+  // Each particle: x, y, [z], [p], [vx, vy, [vz]], [ρ]
   double *P = alg->get_pressure();
-  for (auto &p : particles) {
-    write_single(file, p.pos.x);
-    write_single(file, p.pos.y);
-    if (output_flags & SIM_PRESSURE) write_single(file, P[p.idx]);
+  std::string buffer;
+  auto append_particle = [&](Particle &p) {
+    append_vec(buffer, p.pos);
+    if (output_flags & SIM_PRESSURE) append<float>(buffer, P[p.idx]);
+    if (output_flags & SIM_VELOCITY) append_vec(buffer, p.vel);
+    if (output_flags & SIM_DENSITY) append<float>(buffer, p.rho);
+  };
+
+  // Emitters and sinks changed the particles: 2, then the new particle set
+  // as in the header
+  if (particle_set_changed) {
+    append<uint8_t>(buffer, 2);
+    append_particle_set(buffer);
+    particle_set_changed = false;
+  }
+  append<uint8_t>(buffer, 1);
+  append<float>(buffer, time);
+  if (output_flags & SIM_SELECTION) {
+    // Bitmask of the selected particles (bit i%8 of byte i/8), then their
+    // channels in order
+    size_t mask_offset = buffer.size();
+    buffer.append((particles.size() + 7) / 8, 0);
+    int fluid_index = 0;
+    for (Particle &p : particles) {
+      if (selected(p, fluid_index)) {
+        buffer[mask_offset + p.idx / 8] |= 1 << (p.idx % 8);
+        append_particle(p);
+      }
+      if (!p.boundary_particle) fluid_index++;
+    }
+  } else {
+    for (Particle &p : particles) {
+      append_particle(p);
+    }
   }
+  file.write(buffer.data(), buffer.size());
 }
 
-void World::write_footers(std::ofstream &file) {
+void World::write_footers(std::ostream &file) {
   uint8_t next_frame = 0;
   file.write(reinterpret_cast<char *>(&next_frame), sizeof(uint8_t));
 }
 
-void World::sanity_checks() {
-  // Check for NaNs
-  for (auto p: particles) {
-    assert(!std::isnan(p.pos.x));
-    assert(!std::isnan(p.pos.y));
-    assert(!std::isnan(p.vel.x));
-    assert(!std::isnan(p.vel.y));
+std::string World::check_health() {
+  int non_finite = 0;
+  double max_density_error = 0.0, max_vel_sq = 0.0;
+  #pragma omp parallel for reduction(+: non_finite) reduction(max: max_density_error, max_vel_sq)
+  for (Particle &p: particles) {
+    // NaN and Inf propagate to the sum
+    double sum = p.rho + p.pos.x + p.pos.y + p.vel.x + p.vel.y;
+#if SPH_DIM == 3
+    sum += p.pos.z + p.vel.z;
+#endif
+    if (!std::isfinite(sum)) non_finite++;
+    if (p.boundary_particle) continue;
+    double rho_0 = rest_density(p);
+    max_density_error = std::max(max_density_error, std::abs(p.rho - rho_0) / rho_0);
+    max_vel_sq = std::max(max_vel_sq, norm_square(p.vel));
   }
+
+  char problem[100] = "";
+  if (non_finite > 0) {
+    snprintf(problem, sizeof(problem), "%d particles with NaN or Inf", non_finite);
+  } else if (max_density_error > health_density_error) {
+    snprintf(problem, sizeof(problem), "density error %.3f", max_density_error);
+  } else if (std::sqrt(max_vel_sq) > health_velocity) {
+    snprintf(problem, sizeof(problem), "speed %.3f", std::sqrt(max_vel_sq));
+  }
+  return problem;
+}
+
+void World::take_snapshot() {
+  if ((int) snapshots.size() == max_snapshots) snapshots.pop_front();
+  snapshots.push_back({std::vector<Particle>(particles.begin(), particles.end()), time, steps, emitters});
+  steps_since_snapshot = 0;
+  // Snapshots short of the failure don't count as recovered, or a failure
+  // that halving dt can't fix would be retried forever
+  if (time > failed_time) rollbacks_in_row = 0;
+}
+
+void World::rollback(std::string problem) {
+  rollbacks_in_row++;
+  if (rollbacks_in_row > max_rollbacks) {
+    std::cerr << "Step at t = " << time << " failed (" << problem << ") after " << max_rollbacks << " rollbacks" << std::endl;
+    exit(1);
+  }
+  // The newest snapshot failed again, it may already be past saving
+  if (rollbacks_in_row > 2 && snapshots.size() > 1) snapshots.pop_back();
+
+  Snapshot &snapshot = snapshots.back();
+  std::cerr << "Step at t = " << time << " failed (" << problem << "), rolling back to t = " << snapshot.time << " with max_dt " << max_dt / 2 << std::endl;
+  if (user_max_dt == 0) user_max_dt = max_dt;
+  max_dt /= 2;
+  failed_time = std::max(failed_time, time);
+  particles.assign(snapshot.particles.begin(), snapshot.particles.end());
+  time = snapshot.time;
+  steps = snapshot.steps;
+  emitters = snapshot.emitters;
+  steps_since_snapshot = 0;
+  // The solvers' per particle state restarts from zero
+  particles_changed(std::vector<int>(particles.size(), -1));
+  if (emitters.empty() && sinks.empty()) particle_set_changed = false;
 }
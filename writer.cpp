@@ -0,0 +1,63 @@
+#include "writer.h"
+#include <iostream>
+
+AsyncWriter::AsyncWriter(size_t max_queued_bytes): max_queued_bytes(max_queued_bytes) {
+  queued_bytes = 0;
+  done = false;
+  thread = std::thread(&AsyncWriter::run, this);
+}
+
+AsyncWriter::~AsyncWriter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    done = true;
+  }
+  job_queued.notify_one();
+  thread.join();
+}
+
+void AsyncWriter::write(std::string filename, std::string data) {
+  std::unique_lock<std::mutex> lock(mutex);
+  job_done.wait(lock, [this] { return queued_bytes <= max_queued_bytes || queue.empty(); });
+  queued_bytes += data.size();
+  queue.push_back({filename, std::move(data), false});
+  lock.unlock();
+  job_queued.notify_one();
+}
+
+void AsyncWriter::close(std::string filename) {
+  std::unique_lock<std::mutex> lock(mutex);
+  queue.push_back({filename, "", true});
+  lock.unlock();
+  job_queued.notify_one();
+}
+
+void AsyncWriter::run() {
+  while (true) {
+    std::unique_lock<std::mutex> lock(mutex);
+    job_queued.wait(lock, [this] { return done || !queue.empty(); });
+    if (queue.empty()) break;
+    Job job = std::move(queue.front());
+    queue.pop_front();
+    lock.unlock();
+
+    if (job.close) {
+      files.erase(job.filename);
+    } else {
+      auto file = files.find(job.filename);
+      if (file == files.end()) {
+        file = files.emplace(job.filename, std::ofstream(job.filename, std::ios::binary)).first;
+        if (!file->second) {
+          std::cerr << "Couldn't open file to save state  file: " << job.filename << std::endl;
+          exit(1);
+        }
+      }
+      file->second.write(job.data.data(), job.data.size());
+    }
+
+    lock.lock();
+    queued_bytes -= job.data.size();
+    lock.unlock();
+    job_done.notify_all();
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef __SPH_WRITER
+#define __SPH_WRITER
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+// Writes buffers to files on a background thread so that simulation loops
+// don't wait on the disk. One writer is shared by all the worlds of the
+// process. Buffers of the same file are written in the order they were
+// queued, and write() blocks only while more than max_queued_bytes are
+// waiting.
+class AsyncWriter {
+  typedef struct {
+    std::string filename;
+    std::string data;
+    bool close;
+  } Job;
+
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable job_queued;
+  std::condition_variable job_done;
+  std::deque<Job> queue;
+  size_t queued_bytes;
+  size_t max_queued_bytes;
+  bool done;
+  std::unordered_map<std::string, std::ofstream> files;
+  void run();
+
+public:
+  AsyncWriter(size_t max_queued_bytes);
+  // Writes everything queued and closes the files
+  ~AsyncWriter();
+  // Appends data to filename, which is created on its first write
+  void write(std::string filename, std::string data);
+  void close(std::string filename);
+};
+
+#endif